@@ -0,0 +1,472 @@
+/**
+ * main.c
+ * RS-485 bootloader that receives application images over the bus.
+ * 
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include "config.h"
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <util/crc16.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include "global_pins.h"
+#include "uart.h"
+#include "buscomm.h"
+#include "nvmconfig.h"
+
+/*
+ * The application resets into us with BOOT, and we also stay put whenever the
+ * application image isn't valid. We only understand binary frames in the same
+ * SYNC ADDR OPCODE LEN PAYLOAD CHK layout as the application, and each of them
+ * should be preceded by a break and a 0x55 sync, so that our baud rate follows
+ * the master's. Frames to the broadcast address are never replied to, and
+ * replies use the same layout with our address and the request's opcode.
+ * 
+ *   BL_START                        Invalidate the image and start over.
+ *   BL_BLOCK   page data[64]        Write a page of the image.
+ *   BL_MISSING pages                Reply with a bitmap of the missing pages.
+ *   BL_END     pages crc_lo crc_hi  Check and accept the image.
+ *   BL_RUN                          Start the application if it's valid.
+ * 
+ * The image CRC is a CRC-16/XMODEM of all of its pages. A whole bus is updated
+ * by broadcasting BL_START and every BL_BLOCK, asking each node for its
+ * BL_MISSING pages and sending those to it alone, then sending BL_END to each
+ * node and broadcasting BL_RUN. Our opcodes are outside of the range used by
+ * the application, so nodes that missed the BOOT simply ignore all of this.
+ * 
+ * Writing a page halts the CPU for a few milliseconds and the USART can only
+ * hold on to a couple of bytes meanwhile, so the master must leave the bus
+ * quiet for at least BOOT_WRITE_GAP milliseconds after every BL_START and
+ * BL_BLOCK before sending anything else. Replied frames need no gap since the
+ * reply is only sent once we're done.
+ */
+typedef enum {
+	BL_START = 0x80,
+	BL_BLOCK,
+	BL_MISSING,
+	BL_END,
+	BL_RUN
+} boot_opcode_t;
+
+// Status replies.
+typedef enum {
+	BL_STATUS_OK = 0,
+	BL_STATUS_MISSING,
+	BL_STATUS_BADCRC,
+	BL_STATUS_INVALID
+} boot_status_t;
+
+// Some definitions.
+#define BOOT_APP_START   BOOT_SECTION_SIZE
+#define BOOT_PAGE_SIZE   PROGMEM_PAGE_SIZE
+#define BOOT_APP_PAGES   (((PROGMEM_SIZE - BOOT_APP_START) / BOOT_PAGE_SIZE) - 1)
+#define BOOT_INFO_ADDR   (BOOT_APP_START + (BOOT_APP_PAGES * BOOT_PAGE_SIZE))
+#define BOOT_PAYLOAD_MAX (BOOT_PAGE_SIZE + 1)
+#define BOOT_WRITE_GAP   10  // Milliseconds that a page write may take.
+#define BAUD_DIVISOR(BAUD_RATE) ((uint16_t)((((uint32_t)F_CPU * 4) + \
+	((BAUD_RATE) / 2)) / (BAUD_RATE)))
+
+// Image information. (Stored in the last page of the flash)
+typedef struct {
+	uint8_t pages;
+	uint16_t crc;
+} boot_info_t;
+
+// Received frame.
+typedef struct {
+	uint8_t addr;
+	uint8_t opcode;
+	uint8_t len;
+	uint8_t payload[BOOT_PAYLOAD_MAX];
+} boot_frame_t;
+
+// Private variables.
+static uint8_t boot_addr;
+static int8_t boot_clock_cal;
+static uint8_t boot_received[(BOOT_APP_PAGES + 7) / 8];
+static boot_frame_t boot_frame;
+
+// Baud rate divisors for each of the supported baud rates.
+static const uint16_t boot_baud_divisors[UART_BAUD_NUM] PROGMEM = {
+	BAUD_DIVISOR(9600),
+	BAUD_DIVISOR(19200),
+	BAUD_DIVISOR(38400),
+	BAUD_DIVISOR(57600),
+	BAUD_DIVISOR(115200)
+};
+
+// Private methods.
+static uint8_t Boot_LoadConfig(void);
+static void Boot_InitializeUART(uint8_t baud);
+static uint8_t Boot_ReceiveByte(uint8_t *crc);
+static bool Boot_ReceiveFrame(boot_frame_t *frame);
+static void Boot_SendFrame(uint8_t opcode, const uint8_t *payload, uint8_t len);
+static void Boot_HandleFrame(boot_frame_t *frame);
+static uint8_t Boot_FinishImage(uint8_t pages, uint16_t crc);
+static void Boot_WritePage(uint8_t page, const uint8_t *data);
+static void Boot_WriteInfo(uint8_t pages, uint16_t crc);
+static void Boot_Program(void);
+static uint16_t Boot_ImageCRC(uint8_t pages);
+static bool Boot_IsAppValid(void);
+static void Boot_RunApp(void);
+
+/**
+ * Bootloader's main entry point.
+ * 
+ * @return Never returns.
+ */
+int main(void) {
+	// No prescaler, so checking the image doesn't take forever.
+	_PROTECTED_WRITE(CLKCTRL.MCLKCTRLB, 0);
+	
+	// Go straight to the application unless it asked for us or isn't valid.
+	if (!(RSTCTRL.RSTFR & RSTCTRL_SWRF_bm) && Boot_IsAppValid())
+		Boot_RunApp();
+	RSTCTRL.RSTFR = RSTCTRL_SWRF_bm;
+	
+	// Let everyone know that we are in the bootloader.
+	PORTC.DIRSET = STATUS_LED;
+	PORTC.OUTSET = STATUS_LED;
+	
+	// Set up the bus with the configuration that the application left us.
+	PORTB.DIRSET = (TXD | TX_EN);
+	Boot_InitializeUART(Boot_LoadConfig());
+	
+	// Handle frames forever. (Or until we're told to run the application)
+	while (1) {
+		if (Boot_ReceiveFrame(&boot_frame))
+			Boot_HandleFrame(&boot_frame);
+	}
+	
+	return 0;
+}
+
+/**
+ * Gets our bus address, clock calibration factor and baud rate from the newest
+ * valid configuration record that the application left in the EEPROM.
+ * 
+ * @return Baud rate from the uart_baud_t enum.
+ */
+static uint8_t Boot_LoadConfig(void) {
+	const config_eeprom_t *ee = (const config_eeprom_t *)MAPPED_EEPROM_START;
+	const config_t *cfg = NULL;
+	const uint8_t *p;
+	uint8_t crc;
+	uint8_t i;
+	uint8_t j;
+	
+	// Pick the valid record with the newest sequence number.
+	for (i = 0; i < CONFIG_SLOTS; i++) {
+		p = (const uint8_t *)&ee->slots[i];
+		crc = 0;
+		for (j = 0; j < offsetof(config_t, crc); j++)
+			crc = _crc8_ccitt_update(crc, p[j]);
+		
+		if ((ee->slots[i].version != CONFIG_VERSION) ||
+				(ee->slots[i].crc != crc)) {
+			continue;
+		}
+		if ((cfg == NULL) || ((int8_t)(ee->slots[i].seq - cfg->seq) > 0))
+			cfg = &ee->slots[i];
+	}
+	
+	// Fall back to the same defaults as the application.
+	if (cfg == NULL) {
+		boot_addr = 1;
+		boot_clock_cal = 0;
+		return UART_BAUD_9600;
+	}
+	
+	boot_addr = cfg->our_addr;
+	boot_clock_cal = cfg->clock_cal;
+	return (cfg->baud < UART_BAUD_NUM) ? cfg->baud : UART_BAUD_9600;
+}
+
+/**
+ * Sets up the UART peripheral for communication, correcting the divisor the
+ * same way as the application so we keep talking at the rate it was tuned to.
+ * 
+ * @param baud Desired baud rate from the uart_baud_t enum.
+ */
+static void Boot_InitializeUART(uint8_t baud) {
+	int32_t div;
+	
+	div = pgm_read_word(&boot_baud_divisors[baud]);
+	div += ((div * (int8_t)SIGROW.OSC20ERR5V) / 1024) +
+		((div * boot_clock_cal) / BAUD_DIVISOR(9600));
+	
+	PORTB.OUTCLR = TX_EN;
+	USART0.BAUD  = (uint16_t)div;
+	USART0.CTRLB = USART_RXEN_bm | USART_TXEN_bm | USART_RXMODE_GENAUTO_gc;
+}
+
+/**
+ * Waits for a byte from the bus.
+ * 
+ * @param  crc CRC-8 to be updated with the byte.
+ * @return     Received byte.
+ */
+static uint8_t Boot_ReceiveByte(uint8_t *crc) {
+	uint8_t b;
+	
+	while (!(USART0.STATUS & USART_RXCIF_bm)) {
+		// Don't let a bad sync field get in the way.
+		if (USART0.STATUS & USART_ISFIF_bm)
+			USART0.STATUS = USART_ISFIF_bm;
+	}
+	
+	b = USART0.RXDATAL;
+	*crc = _crc8_ccitt_update(*crc, b);
+	
+	return b;
+}
+
+/**
+ * Waits for a binary frame from the bus.
+ * 
+ * @param  frame Frame structure to be populated.
+ * @return       TRUE if the frame is intact.
+ */
+static bool Boot_ReceiveFrame(boot_frame_t *frame) {
+	uint8_t crc;
+	uint8_t chk;
+	uint8_t i;
+	
+	// Wait for the start of a frame.
+	do {
+		crc = 0;
+	} while (Boot_ReceiveByte(&crc) != COMMS_BIN_SYNC);
+	
+	// Header.
+	crc = 0;
+	frame->addr = Boot_ReceiveByte(&crc);
+	frame->opcode = Boot_ReceiveByte(&crc);
+	frame->len = Boot_ReceiveByte(&crc);
+	if (frame->len > BOOT_PAYLOAD_MAX)
+		return false;
+	
+	// Payload and checksum.
+	for (i = 0; i < frame->len; i++)
+		frame->payload[i] = Boot_ReceiveByte(&crc);
+	chk = crc;
+	
+	return Boot_ReceiveByte(&crc) == chk;
+}
+
+/**
+ * Sends a binary frame to the master. The receiver is turned off meanwhile so
+ * we don't read our own frame back.
+ * 
+ * @param opcode  Opcode of the request that we are replying to.
+ * @param payload Payload of the reply.
+ * @param len     Length of the payload.
+ */
+static void Boot_SendFrame(uint8_t opcode, const uint8_t *payload, uint8_t len) {
+	uint8_t header[4] = { COMMS_BIN_SYNC, boot_addr, opcode, len };
+	uint8_t crc = 0;
+	uint8_t b;
+	uint8_t i;
+	
+	USART0.CTRLB &= ~USART_RXEN_bm;
+	USART0.STATUS = USART_TXCIF_bm;
+	PORTB.OUTSET = TX_EN;
+	
+	for (i = 0; i < (sizeof(header) + len + 1); i++) {
+		// Pick the next byte to send.
+		if (i < sizeof(header)) {
+			b = header[i];
+		} else if (i < (sizeof(header) + len)) {
+			b = payload[i - sizeof(header)];
+		} else {
+			b = crc;
+		}
+		if (i > 0)
+			crc = _crc8_ccitt_update(crc, b);
+		
+		while (!(USART0.STATUS & USART_DREIF_bm))
+			;
+		USART0.TXDATAL = b;
+	}
+	
+	// Give the bus back once everything is out.
+	while (!(USART0.STATUS & USART_TXCIF_bm))
+		;
+	PORTB.OUTCLR = TX_EN;
+	USART0.CTRLB |= USART_RXEN_bm;
+}
+
+/**
+ * Handles a frame that we've received.
+ * 
+ * @param frame Received frame.
+ */
+static void Boot_HandleFrame(boot_frame_t *frame) {
+	bool unicast = frame->addr == boot_addr;
+	uint8_t status;
+	uint8_t page;
+	uint8_t i;
+	
+	// Is it for us?
+	if (!unicast && (frame->addr != 0))
+		return;
+	
+	switch (frame->opcode) {
+	case BL_START:
+		Boot_WriteInfo(0xFF, 0xFFFF);
+		memset(boot_received, 0, sizeof(boot_received));
+		status = BL_STATUS_OK;
+		break;
+	case BL_BLOCK:
+		// Blocks are never replied to, the master asks for missing ones later.
+		page = frame->payload[0];
+		if ((frame->len != BOOT_PAYLOAD_MAX) || (page >= BOOT_APP_PAGES))
+			return;
+		
+		Boot_WritePage(page, frame->payload + 1);
+		boot_received[page / 8] |= _BV(page % 8);
+		return;
+	case BL_MISSING:
+		if (!unicast || (frame->len < 1) || (frame->payload[0] > BOOT_APP_PAGES))
+			return;
+		
+		// Build the bitmap of missing pages in place.
+		page = frame->payload[0];
+		for (i = 0; i < ((page + 7) / 8); i++)
+			frame->payload[i] = ~boot_received[i];
+		if (page % 8)
+			frame->payload[(page - 1) / 8] &= _BV(page % 8) - 1;
+		
+		Boot_SendFrame(BL_MISSING, frame->payload, (page + 7) / 8);
+		return;
+	case BL_END:
+		if (frame->len < 3)
+			return;
+		
+		status = Boot_FinishImage(frame->payload[0],
+			frame->payload[1] | (frame->payload[2] << 8));
+		break;
+	case BL_RUN:
+		if (Boot_IsAppValid())
+			Boot_RunApp();
+		
+		status = BL_STATUS_INVALID;
+		break;
+	default:
+		return;
+	}
+	
+	if (unicast)
+		Boot_SendFrame(frame->opcode, &status, 1);
+}
+
+/**
+ * Checks that we've got the whole image and that it's intact, marking it as
+ * valid if it is.
+ * 
+ * @param  pages Number of pages in the image.
+ * @param  crc   CRC-16 of the image.
+ * @return       Status from the boot_status_t enum.
+ */
+static uint8_t Boot_FinishImage(uint8_t pages, uint16_t crc) {
+	uint8_t i;
+	
+	if ((pages == 0) || (pages > BOOT_APP_PAGES))
+		return BL_STATUS_INVALID;
+	
+	for (i = 0; i < pages; i++) {
+		if (!(boot_received[i / 8] & _BV(i % 8)))
+			return BL_STATUS_MISSING;
+	}
+	
+	if (Boot_ImageCRC(pages) != crc)
+		return BL_STATUS_BADCRC;
+	
+	Boot_WriteInfo(pages, crc);
+	return BL_STATUS_OK;
+}
+
+/**
+ * Writes a page of the application image to the flash.
+ * 
+ * @param page Index of the page in the image.
+ * @param data Contents of the page.
+ */
+static void Boot_WritePage(uint8_t page, const uint8_t *data) {
+	volatile uint8_t *dst = (volatile uint8_t *)(MAPPED_PROGMEM_START +
+		BOOT_APP_START + ((uint16_t)page * BOOT_PAGE_SIZE));
+	uint8_t i;
+	
+	for (i = 0; i < BOOT_PAGE_SIZE; i++)
+		dst[i] = data[i];
+	
+	Boot_Program();
+}
+
+/**
+ * Writes the image information page. Everything but the information itself is
+ * left erased.
+ * 
+ * @param pages Number of pages in the image. (0xFF for none)
+ * @param crc   CRC-16 of the image.
+ */
+static void Boot_WriteInfo(uint8_t pages, uint16_t crc) {
+	volatile boot_info_t *info = (volatile boot_info_t *)(MAPPED_PROGMEM_START +
+		BOOT_INFO_ADDR);
+	
+	info->pages = pages;
+	info->crc = crc;
+	
+	Boot_Program();
+}
+
+/**
+ * Erases and writes the flash page that was loaded into the page buffer.
+ */
+static void Boot_Program(void) {
+	_PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, NVMCTRL_CMD_PAGEERASEWRITE_gc);
+	while (NVMCTRL.STATUS & NVMCTRL_FBUSY_bm)
+		;
+}
+
+/**
+ * Calculates the CRC of the application image in flash.
+ * 
+ * @param  pages Number of pages in the image.
+ * @return       CRC-16/XMODEM of the image.
+ */
+static uint16_t Boot_ImageCRC(uint8_t pages) {
+	const uint8_t *p = (const uint8_t *)(MAPPED_PROGMEM_START + BOOT_APP_START);
+	uint16_t len = (uint16_t)pages * BOOT_PAGE_SIZE;
+	uint16_t crc = 0;
+	
+	while (len--)
+		crc = _crc_xmodem_update(crc, *p++);
+	
+	return crc;
+}
+
+/**
+ * Checks if there's a complete and intact application in flash.
+ * 
+ * @return TRUE if the application can be run.
+ */
+static bool Boot_IsAppValid(void) {
+	const boot_info_t *info = (const boot_info_t *)(MAPPED_PROGMEM_START +
+		BOOT_INFO_ADDR);
+	
+	if ((info->pages == 0) || (info->pages > BOOT_APP_PAGES))
+		return false;
+	
+	return Boot_ImageCRC(info->pages) == info->crc;
+}
+
+/**
+ * Jumps to the application's reset vector. The application sets up every
+ * peripheral that we've touched on its own.
+ */
+static void Boot_RunApp(void) {
+	((void (*)(void))(BOOT_APP_START / 2))();
+}
@@ -9,18 +9,84 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <util/delay.h>
+#include <util/atomic.h>
 #include <stdbool.h>
+#include <string.h>
 #include "uart.h"
+#include "rtc.h"
 #include "strutils.h"
 #include "nvmconfig.h"
+#include "crc.h"
+#include "profile.h"
+
+// Private definitions.
+#define FRAME_QUEUE_MASK (FRAME_QUEUE_LEN - 1)
 
 // Private variables.
-static volatile char comms_rcv_buf[FRAME_MAX_LEN];
-static volatile comms_frame_t comms_rcv_frame;
-static volatile uint8_t comms_ch_rcvd;
-static volatile bool comms_frame_parse_rdy;
+static volatile comms_rx_frame_t comms_rcv_frames[FRAME_QUEUE_LEN];
+static volatile uint8_t comms_rcv_head;
+static volatile uint8_t comms_rcv_tail;
+static volatile comms_rx_frame_t *comms_rx_frame;
+static comms_frame_t comms_cur_cmd = { .command = "" };
+static const comms_frame_t *comms_cur_frame = &comms_cur_cmd;
+static bool comms_batch;
+static uint8_t comms_batch_replies;
+static volatile uint8_t comms_rx_addr;
+static volatile uint8_t comms_rx_opcode;
+static volatile bool comms_rx_has_seq;
+static volatile uint8_t comms_rx_seq;
+static volatile uint8_t comms_rx_crc;
+static volatile uint8_t comms_rx_frame_crc;
+static volatile comms_stage_t comms_stage;
+static volatile uint8_t comms_tok_len;
+static volatile uint8_t comms_rx_nargs;
+static volatile comms_stats_t comms_stats;
+static uint8_t comms_tx_crc;
+static bool comms_seq_valid;
+static uint8_t comms_last_seq;
+static char comms_reply_cache[COMMS_REPLY_CACHE_LEN];
+static uint8_t comms_cache_len;
+static bool comms_cache_overflow;
+static bool comms_caching;
+static bool comms_repeat;
+#ifdef PROF_ENABLED
+static uint16_t comms_prof_reply;
+#endif
+static volatile uint8_t comms_pending_baud = BAUD_NONE;
+static volatile uint8_t comms_baud_gen;
+static bool comms_baud_commit;
+static volatile bool comms_baud_expired;
+static rtc_timer_t comms_baud_timer;
+static volatile uint16_t comms_last_rx_tick;
+static volatile comms_annc_state_t comms_annc_state;
+static volatile uint8_t comms_annc_echo_len;
+static volatile bool comms_annc_collided;
+static bool comms_annc_reply;
+static bool comms_annc_holding;
+static uint8_t comms_annc_slot;
+static char comms_annc_msg[ANNC_MSG_MAX_LEN + 1];
+static uint8_t comms_annc_attempt;
+static uint16_t comms_annc_busy_tick;
 static volatile char comms_our_addr_str[4];
 
+// Private methods.
+static void Comms_AnnounceBegin(void);
+static bool Comms_AnnounceTask(void);
+static void Comms_SwitchBaudRate(void);
+static uint8_t Comms_AnnounceSlot(void);
+static bool Comms_IsForUs(uint8_t addr);
+static bool Comms_IsRetransmission(const comms_rx_frame_t *rx);
+static void Comms_HandleFrame(const comms_rx_frame_t *rx);
+static const char* Comms_LoadCommand(const comms_rx_frame_t *rx,
+									 const char *tok);
+static bool Comms_StartFrame(bool binary);
+static bool Comms_AppendDigit(volatile uint8_t *n, char c);
+static bool Comms_IsTokenEnd(char c);
+static bool Comms_IsCommandEnd(char c);
+static bool Comms_AppendByte(uint8_t b);
+static void Comms_ReplyTap(uint8_t b);
+static void Comms_EndReplyLine(void);
+
 /**
  * Initializes the bus communication stuff.
  * 
@@ -28,76 +94,301 @@ static volatile char comms_our_addr_str[4];
  */
 void Comms_Initialize(uint8_t addr) {
 	Comms_SetOurAddress(addr, false);
+	RTC_Timer_Setup(&comms_baud_timer, false, BAUD_FALLBACK_TIMEOUT);
 }
 
 /**
- * Parses the received frame and takes action on it if needed.
+ * Dispatches the oldest received frame if there's one waiting to be handled.
  */
 void Comms_ParseFrame(void) {
-	const char *buf;
-	char *tmp;
-	int8_t skip = 0;
-	
-	// Do nothing if we don't have a frame to parse.
-	if (!comms_frame_parse_rdy) {
-		// Check if we ran into an exception while receiving data.
-		if (comms_ch_rcvd >= (FRAME_MAX_LEN - 1))
-			goto finish;
+	const comms_rx_frame_t *rx;
+	uint8_t len;
+	PROF_START(prof);
+	
+	// Finish sending the reply to a group frame before handling anything else.
+	if (comms_annc_reply) {
+		if (!Comms_AnnounceTask())
+			return;
 		
+		comms_annc_reply = false;
+	}
+	
+	// Switch baud rates once the reply to the frame that asked for it is out.
+	if (comms_baud_commit && !comms_annc_reply)
+		Comms_SwitchBaudRate();
+	
+	// Nobody talked to us after a baud rate switch, so let's go back.
+	if (comms_baud_expired) {
+		comms_baud_expired = false;
+		UART_Initialize(Config_GetBaudRate());
+	}
+	
+	// Do nothing if we don't have a frame to handle.
+	if (comms_rcv_head == comms_rcv_tail)
 		return;
+	
+	// The receiver won't touch the frame until we release its slot.
+	rx = (const comms_rx_frame_t *)
+		&comms_rcv_frames[comms_rcv_tail & FRAME_QUEUE_MASK];
+	
+	// A valid frame proves that a new baud rate works, so let's keep it. Only
+	// frames that started arriving after the switch count as proof.
+	if (comms_baud_timer.enabled && (rx->baud_gen == comms_baud_gen)) {
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			RTC_Timer_Stop(&comms_baud_timer);
+			comms_baud_expired = false;
+		}
+		Config_SetBaudRate(UART_GetBaudRate());
+	}
+	
+	// Learn from the bit timing that got this frame through.
+	UART_TrackClockCal();
+	
+	// Wait for any announcement to go out since group and broadcast replies
+	// may need its slot.
+	if (((rx->addr == 0) || (rx->addr >= COMMS_GROUP_ADDR_BASE)) &&
+			Comms_IsAnnouncing()) {
+		return;
+	}
+	
+	if (Comms_IsRetransmission(rx)) {
+		// Already handled this one.
+	} else {
+		// Group replies are always sent in our slot.
+		if (rx->addr >= COMMS_GROUP_ADDR_BASE)
+			Comms_HoldReply(ANNC_SLOT_AUTO);
+		
+		Comms_HandleFrame(rx);
+		
+		// Send the reply that we've held on to in its slot.
+		if (comms_annc_holding) {
+			comms_annc_holding = false;
+			len = UART_StopCapture();
+			
+			// Never send a reply that was cut short, it would garble the line.
+			if (UART_CaptureOverflowed()) {
+				comms_cache_len = 0;
+				comms_cache_overflow = false;
+				UART_StartCapture(comms_annc_msg, sizeof(comms_annc_msg));
+				Comms_Reply("OVERFLOW");
+				len = UART_StopCapture();
+			}
+			
+			if (len > 0) {
+				comms_annc_reply = true;
+				Comms_AnnounceBegin();
+			}
+		}
 	}
 	
-	// Set some things beforehand.
-	comms_rcv_frame.num_args = 0;
-	buf = comms_rcv_buf;
-
-	// Check if we've received a frame from the master.
-	if (*buf++ != ':')
-		goto finish;
-	
-	// Parse the address.
-	skip = atou8(&comms_rcv_frame.addr, buf);
-	buf += skip;
-	if (*buf++ != ' ')
-		goto finish;
-	
-	// Parse the command.
-	tmp = &comms_rcv_frame.command;
-	while ((*buf != ' ') && (*buf != '\r')) {
-		*tmp++ = *buf;
-		buf++;
+	// Stop caching the reply.
+	if (comms_caching) {
+		comms_caching = false;
+		comms_reply_cache[comms_cache_len] = '\0';
 	}
-	*tmp = '\0';
-	buf++;
+	
+	// Hand the slot back to the receiver.
+	comms_rcv_tail++;
+	
+	// The whole reply has been queued up at the old baud rate by now.
+	if (comms_baud_commit && !comms_annc_reply)
+		Comms_SwitchBaudRate();
+	
+	PROF_END(PROF_PARSE, prof);
+}
 
-	// Parse the arguments.
-	while ((*buf != '\r') && (*buf != '\n')) {
-		// Check if we've overflowed the number of arguments allowed.
-		if (comms_rcv_frame.num_args == ARGS_MAX)
-			goto finish;
+/**
+ * Checks if a frame is a retransmission of the last one, answering it from the
+ * reply cache if it is. Otherwise its sequence number is remembered and its
+ * reply gets cached. Retransmissions whose reply didn't fit in the cache are
+ * handled again, so commands with long replies must be safe to repeat.
+ * 
+ * @param  rx Received frame.
+ * @return    TRUE if the frame is a retransmission and shouldn't be handled.
+ */
+static bool Comms_IsRetransmission(const comms_rx_frame_t *rx) {
+	// Frames without a sequence number are always handled.
+	comms_repeat = false;
+	if (!rx->has_seq)
+		return false;
+	
+	// Is this the same frame that we've handled last?
+	comms_repeat = comms_seq_valid && (rx->seq == comms_last_seq);
+	if (comms_repeat) {
+		comms_stats.duplicates++;
 		
-		// Parse a new argument.
-		tmp = &comms_rcv_frame.args[comms_rcv_frame.num_args];
-		while ((*buf != ' ') && (*buf != '\r')) {
-			*tmp++ = *buf;
-			buf++;
+		// Only repeat replies that we are the only one sending.
+		if ((rx->addr == 0) || (rx->addr >= COMMS_GROUP_ADDR_BASE))
+			return true;
+		
+		// Send the same reply again if we've got all of it.
+		if (!comms_cache_overflow) {
+			UART_SendString(comms_reply_cache);
+			return true;
 		}
-		*tmp = '\0';
-		buf++;
+	}
+	
+	// Remember this frame and cache its reply.
+	comms_last_seq = rx->seq;
+	comms_seq_valid = true;
+	comms_cache_len = 0;
+	comms_cache_overflow = false;
+	comms_caching = true;
+	
+	return false;
+}
+
+/**
+ * Runs all of the commands in a frame, but only if all of them are valid.
+ * 
+ * @param rx Received frame.
+ */
+static void Comms_HandleFrame(const comms_rx_frame_t *rx) {
+	const char *end = rx->buf + rx->len;
+	const char *tok;
+	uint8_t num_cmds = 0;
+	
+	// Make sure every command can be run before running any of them.
+	tok = rx->buf;
+	do {
+		tok = Comms_LoadCommand(rx, tok);
+		if (!Comms_CheckCommand(comms_cur_frame))
+			return;
 		
-		// Increase the argument counter.
-		comms_rcv_frame.num_args++;
+		num_cmds++;
+	} while (tok < end);
+	
+	// Run them with their replies combined into a single one.
+	comms_batch = num_cmds > 1;
+	comms_batch_replies = 0;
+	tok = rx->buf;
+	do {
+		PROF_START(prof);
+		tok = Comms_LoadCommand(rx, tok);
+		Comms_HandleCommand(comms_cur_frame);
+		PROF_END(PROF_DISPATCH, prof);
+	} while (tok < end);
+	
+	// Finish the combined reply.
+	if (comms_batch && (comms_batch_replies > 0))
+		Comms_EndReplyLine();
+	comms_batch = false;
+}
+
+/**
+ * Loads a command from a received frame into the current command structure.
+ * 
+ * @param  rx  Received frame.
+ * @param  tok First token of the command.
+ * @return     First token of the next command.
+ */
+static const char* Comms_LoadCommand(const comms_rx_frame_t *rx,
+									 const char *tok) {
+	const char *end = rx->buf + rx->len;
+	
+	comms_cur_cmd.addr = rx->addr;
+	comms_cur_cmd.binary = rx->binary;
+	comms_cur_cmd.opcode = rx->opcode;
+	comms_cur_cmd.crc = rx->crc;
+	comms_cur_cmd.has_seq = rx->has_seq;
+	comms_cur_cmd.repeat = comms_repeat;
+	comms_cur_cmd.num_args = 0;
+	
+	// Binary frames only carry a single command.
+	if (rx->binary) {
+		comms_cur_cmd.command = "";
+		comms_cur_cmd.args[0] = rx->buf;
+		comms_cur_cmd.num_args = rx->len;
+		
+		return end;
 	}
 	
-	// Is this message for us? Should we handle it?
-	if ((comms_rcv_frame.addr == 0) ||
-			(comms_rcv_frame.addr == Config_GetOurAddress())) {
-		Comms_HandleCommand(&comms_rcv_frame);
+	// Command and its arguments up to the next separator.
+	comms_cur_cmd.command = tok;
+	tok += strlen(tok) + 1;
+	while ((tok < end) && (*tok != '\0')) {
+		comms_cur_cmd.args[comms_cur_cmd.num_args++] = tok;
+		tok += strlen(tok) + 1;
 	}
+	
+	return tok + 1;
+}
 
-finish:
-	// Get ready to receive more shit.
-	Comms_ResetRXBuffer();
+/**
+ * Checks if the bus is idle, which means that we are not in the middle of
+ * receiving a frame and aren't transmitting. This only looks at the wire, since
+ * frames waiting in our own queue may themselves be waiting for an
+ * announcement to go out.
+ * 
+ * @return TRUE if it's a good time to send something unsolicited.
+ */
+bool Comms_IsBusIdle(void) {
+	return (comms_stage == COMMS_STAGE_READY) && !UART_IsTransmitting();
+}
+
+/**
+ * Checks if there are frames waiting to be handled.
+ * 
+ * @return TRUE if the frame queue isn't empty.
+ */
+bool Comms_IsFramePending(void) {
+	return comms_rcv_head != comms_rcv_tail;
+}
+
+/**
+ * Checks if a frame was addressed only to us, which means that we are the only
+ * one that'll reply to it.
+ * 
+ * @param  frame Frame to be checked.
+ * @return       TRUE if the frame isn't a broadcast or group frame.
+ */
+bool Comms_IsUnicast(const comms_frame_t *frame) {
+	return (frame->addr != 0) && (frame->addr < COMMS_GROUP_ADDR_BASE);
+}
+
+/**
+ * Checks if we are in the middle of receiving a frame.
+ * 
+ * @return TRUE if a frame is currently being received.
+ */
+bool Comms_IsReceiving(void) {
+	return comms_stage != COMMS_STAGE_READY;
+}
+
+/**
+ * Gets an argument of a frame as a uint8_t.
+ * 
+ * @param  frame Frame to get the argument from.
+ * @param  index Index of the argument.
+ * @return       Value of the argument.
+ */
+uint8_t Comms_GetArgU8(const comms_frame_t *frame, uint8_t index) {
+	uint8_t n = 0;
+	
+	// Binary frames carry their arguments as raw bytes.
+	if (frame->binary)
+		return ((const uint8_t *)frame->args[0])[index];
+	
+	atou8(&n, frame->args[index]);
+	return n;
+}
+
+/**
+ * Gets an argument of a frame as a int8_t.
+ * 
+ * @param  frame Frame to get the argument from.
+ * @param  index Index of the argument.
+ * @return       Value of the argument.
+ */
+int8_t Comms_GetArgI8(const comms_frame_t *frame, uint8_t index) {
+	int8_t n = 0;
+	
+	// Binary frames carry their arguments as raw bytes.
+	if (frame->binary)
+		return ((const int8_t *)frame->args[0])[index];
+	
+	atoi8(&n, frame->args[index]);
+	return n;
 }
 
 /**
@@ -121,7 +412,21 @@ void Comms_AddrReplyStart(uint8_t addr) {
 	char nch[4];
 	// TODO: Make sure to check if we are not receiving anything.
 	
+	// Replies to the commands of a batch frame are combined into a single one.
+	if (comms_batch && (comms_batch_replies++ > 0)) {
+		UART_SendChar(COMMS_BATCH_SEP);
+		return;
+	}
+	
+	// Calculate the CRC of the reply and cache it as it goes out.
+	if (comms_cur_frame->crc || comms_caching) {
+		comms_tx_crc = CRC8_INIT;
+		UART_SetTap(Comms_ReplyTap);
+	}
+	
 	// Send reply marker.
+	PROF_STAMP(comms_prof_reply);
+	comms_stats.replies++;
 	UART_SendChar(';');
 	
 	// Our address and the separator.
@@ -136,63 +441,693 @@ void Comms_AddrReplyStart(uint8_t addr) {
  * @param reply Reply message.
  */
 void Comms_Reply(const char *reply) {
-	Comms_AddrReply(comms_rcv_frame.addr, reply);
+	Comms_ReplyStart();
+	UART_SendString(reply);
+	Comms_ReplyEnd();
+}
+
+/**
+ * Sends an unsolicited message to the master (address 0) using our slotted,
+ * collision-avoiding bus access scheme. This must be called repeatedly from the
+ * main loop with the same message until it returns TRUE.
+ * 
+ * @param  msg Message to be sent. (At most ANNC_MSG_MAX_LEN - 5 characters)
+ * @return     TRUE when the message was sent or we gave up on it.
+ */
+bool Comms_Announce(const char *msg) {
+	// A group reply is using the slots right now.
+	if (comms_annc_reply)
+		return false;
+	
+	// Build the message that we'll be sending and reading back.
+	if (comms_annc_state == COMMS_ANNC_IDLE) {
+		strcomb(comms_annc_msg, ";0 ", msg);
+		strcomb(comms_annc_msg, comms_annc_msg, "\r\n");
+		comms_annc_slot = ANNC_SLOT_AUTO;
+		Comms_AnnounceBegin();
+		return false;
+	}
+	
+	return Comms_AnnounceTask();
+}
+
+/**
+ * Holds on to the reply to the frame that's being handled and sends it after
+ * the frame in a backoff slot, like an announcement. Must only be called from
+ * a command handler. A reply in a fixed slot isn't retried if it collides,
+ * since the master can tell that from the garbled reply itself.
+ * 
+ * @param slot Slot to send the reply in or ANNC_SLOT_AUTO.
+ */
+void Comms_HoldReply(uint8_t slot) {
+	if (!comms_annc_holding) {
+		UART_StartCapture(comms_annc_msg, sizeof(comms_annc_msg));
+		comms_annc_holding = true;
+	}
+	
+	comms_annc_slot = slot;
+}
+
+/**
+ * Starts trying to send whatever is in the announcement buffer.
+ */
+static void Comms_AnnounceBegin(void) {
+	comms_annc_attempt = 0;
+	comms_annc_busy_tick = RTC_GetTicks();
+	comms_annc_state = COMMS_ANNC_WAITING;
+}
+
+/**
+ * Keeps sending the announcement buffer until it goes through.
+ * 
+ * @return TRUE when the message was sent or we gave up on it.
+ */
+static bool Comms_AnnounceTask(void) {
+	uint16_t now = RTC_GetTicks();
+	uint16_t last_rx;
+	uint8_t wait;
+	
+	switch (comms_annc_state) {
+	case COMMS_ANNC_IDLE:
+		return true;
+	case COMMS_ANNC_WAITING:
+		// Wait for the bus to be quiet for long enough to reach our slot.
+		if (!Comms_IsBusIdle()) {
+			comms_annc_busy_tick = now;
+			return false;
+		}
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			last_rx = comms_last_rx_tick;
+		}
+		wait = BUS_IDLE_GAP + (Comms_AnnounceSlot() * ANNC_SLOT_TICKS);
+		if (((uint16_t)(now - last_rx) < wait) ||
+				((uint16_t)(now - comms_annc_busy_tick) < wait))
+			return false;
+		
+		// Send it while reading it back.
+		comms_annc_echo_len = 0;
+		comms_annc_collided = false;
+		comms_annc_state = COMMS_ANNC_SENDING;
+		UART_SendString(comms_annc_msg);
+		return false;
+	case COMMS_ANNC_SENDING:
+		// Wait for the message to go out.
+		if (UART_IsTransmitting())
+			return false;
+		
+		// Hearing none of our echo means that the receiver is gated by TX_EN,
+		// but anything short of the whole message means that it got cut off.
+		if ((comms_annc_echo_len != 0) &&
+				(comms_annc_echo_len != strlen(comms_annc_msg))) {
+			comms_annc_collided = true;
+		}
+		
+		// Did it go through?
+		comms_annc_busy_tick = now;
+		if (comms_annc_collided && (comms_annc_slot == ANNC_SLOT_AUTO)) {
+			comms_annc_attempt++;
+			if (comms_annc_attempt < ANNC_ATTEMPTS) {
+				comms_annc_state = COMMS_ANNC_WAITING;
+				return false;
+			}
+			
+			comms_stats.annc_failed++;
+		}
+		
+		comms_annc_state = COMMS_ANNC_IDLE;
+		return true;
+	}
+	
+	return true;
+}
+
+/**
+ * Gets the backoff slot for the current announcement attempt. Each attempt
+ * uses a different set of 3 bits of our address, so nodes with different
+ * addresses are guaranteed to end up in different slots at some point.
+ * 
+ * @return Backoff slot.
+ */
+static uint8_t Comms_AnnounceSlot(void) {
+	uint8_t addr = Config_GetOurAddress();
+	
+	if (comms_annc_slot != ANNC_SLOT_AUTO)
+		return comms_annc_slot;
+	
+	for (uint8_t i = 0; i < comms_annc_attempt; i++)
+		addr = (addr >> 3) | (addr << 5);
+	
+	return addr & (ANNC_SLOTS - 1);
+}
+
+/**
+ * Checks if we are in the middle of sending an announcement.
+ * 
+ * @return TRUE if there's an announcement in progress.
+ */
+bool Comms_IsAnnouncing(void) {
+	return comms_annc_state != COMMS_ANNC_IDLE;
 }
 
 /**
  * Starts a reply to the master.
  */
 void Comms_ReplyStart(void) {
-	Comms_AddrReplyStart(comms_rcv_frame.addr);
+	// Group replies must say who they came from.
+	if (comms_cur_frame->addr >= COMMS_GROUP_ADDR_BASE) {
+		Comms_AddrReplyStart(Config_GetOurAddress());
+		return;
+	}
+	
+	Comms_AddrReplyStart(comms_cur_frame->addr);
 }
 
 /**
  * Ends a reply to the master.
  */
 void Comms_ReplyEnd(void) {
+	// The combined reply of a batch frame is only ended after its last command.
+	if (comms_batch)
+		return;
+	
+	Comms_EndReplyLine();
+}
+
+/**
+ * Ends the reply line, appending the CRC if one is being calculated.
+ */
+static void Comms_EndReplyLine(void) {
+	char hex[3];
+	
+	if (comms_cur_frame->crc) {
+		u8tohex(hex, comms_tx_crc);
+		UART_SendChar(COMMS_CRC_MARK);
+		UART_SendString(hex);
+	}
+	
 	UART_SendString("\r\n");
+	UART_SetTap(NULL);
+	PROF_END(PROF_REPLY, comms_prof_reply);
+}
+
+/**
+ * Keeps track of the CRC of the reply that's being sent and caches it.
+ * 
+ * @param b Byte that's being sent.
+ */
+static void Comms_ReplyTap(uint8_t b) {
+	comms_tx_crc = CRC8_Update(comms_tx_crc, b);
+	
+	// Replies that don't fit are flagged so they never get repeated.
+	if (comms_caching) {
+		if (comms_cache_len < (COMMS_REPLY_CACHE_LEN - 1)) {
+			comms_reply_cache[comms_cache_len++] = (char)b;
+		} else {
+			comms_cache_overflow = true;
+		}
+	}
 }
 
 /**
- * Handles the event of a character on the bus being received.
+ * Handles the event of a character on the bus being received. Frames are
+ * tokenized as they arrive straight into a free slot of the frame queue, so
+ * they are ready to be dispatched as soon as the line feed (or checksum in
+ * the case of binary frames) is received.
  * 
  * @param c Received character.
  */
 void Comms_ReceiveChar(char c) {
-	// Wait for the start of a frame.
-	if ((comms_ch_rcvd == 0) && (c != ':'))
+	uint8_t b = (uint8_t)c;
+	
+	// Keep track of bus activity.
+	comms_last_rx_tick = RTC_GetTicks();
+	comms_stats.rx_bytes++;
+	
+	// Calculate the CRC of ASCII frames up to the CRC mark.
+	if ((comms_stage >= COMMS_STAGE_ADDR) && (comms_stage <= COMMS_STAGE_ARG) &&
+			(c != COMMS_CRC_MARK))
+		comms_rx_crc = CRC8_Update(comms_rx_crc, b);
+	
+	// Check if we are reading back an announcement that we are sending.
+	if (comms_annc_state == COMMS_ANNC_SENDING) {
+		if ((comms_annc_echo_len >= ANNC_MSG_MAX_LEN) ||
+				(comms_annc_msg[comms_annc_echo_len++] != c))
+			comms_annc_collided = true;
+	}
+	
+	switch (comms_stage) {
+	case COMMS_STAGE_READY:
+		// Wait for the start of a frame.
+		if (c == ':') {
+			comms_stats.rx_frames++;
+			comms_rx_addr = 0;
+			comms_rx_has_seq = false;
+			comms_rx_crc = CRC8_Update(CRC8_INIT, b);
+			comms_tok_len = 0;
+			comms_stage = COMMS_STAGE_ADDR;
+		} else if ((b == COMMS_BIN_SYNC) || (b == COMMS_BIN_SYNC_SEQ)) {
+			comms_stats.rx_frames++;
+			comms_rx_has_seq = b == COMMS_BIN_SYNC_SEQ;
+			comms_rx_crc = CRC8_INIT;
+			comms_stage = COMMS_STAGE_BIN_ADDR;
+		}
+		
+		return;
+	case COMMS_STAGE_ADDR:
+		// Parse the address.
+		if ((c >= '0') && (c <= '9')) {
+			if (!Comms_AppendDigit(&comms_rx_addr, c))
+				break;
+			return;
+		}
+		
+		// Check if we've got a sequence number after the address.
+		if ((c == COMMS_SEQ_MARK) && (comms_tok_len > 0)) {
+			comms_rx_has_seq = true;
+			comms_rx_seq = 0;
+			comms_tok_len = 0;
+			comms_stage = COMMS_STAGE_SEQ;
+			return;
+		}
+		/* fall through */
+	case COMMS_STAGE_SEQ:
+		// Parse the sequence number.
+		if ((comms_stage == COMMS_STAGE_SEQ) && (c >= '0') && (c <= '9')) {
+			if (!Comms_AppendDigit(&comms_rx_seq, c))
+				break;
+			return;
+		}
+		
+		// Check if we've got a proper separator after the address.
+		if ((c != ' ') || (comms_tok_len == 0))
+			break;
+		
+		// Drop the frame right away if it isn't for us.
+		if (!Comms_StartFrame(false))
+			goto discard;
+		
+		comms_stage = COMMS_STAGE_NEWCMD;
 		return;
+	case COMMS_STAGE_NEWCMD:
+		// Skip any whitespace before the command.
+		if (c == ' ')
+			return;
+		
+		// Start a new command.
+		comms_tok_len = 0;
+		comms_rx_nargs = 0;
+		comms_stage = COMMS_STAGE_COMMAND;
+		/* fall through */
+	case COMMS_STAGE_COMMAND:
+		// Append to the command until we reach its end.
+		if (!Comms_IsTokenEnd(c)) {
+			if (!Comms_AppendByte(b))
+				break;
+			comms_tok_len++;
+			return;
+		}
+		
+		// Commands can't be empty.
+		if ((comms_tok_len == 0) || !Comms_AppendByte('\0'))
+			break;
+		
+		comms_stage = COMMS_STAGE_NEWARG;
+		if (Comms_IsCommandEnd(c))
+			goto endcmd;
+		return;
+	case COMMS_STAGE_NEWARG:
+		// Skip any whitespace between arguments.
+		if ((c == ' ') || (c == '\r'))
+			return;
+		
+		// Looks like the command or the whole frame has ended.
+		if (Comms_IsCommandEnd(c))
+			goto endcmd;
+		
+		// Check if we've overflowed the number of arguments allowed.
+		if (comms_rx_nargs == ARGS_MAX) {
+			comms_stats.overlength++;
+			break;
+		}
+		
+		// Start a new argument.
+		comms_stage = COMMS_STAGE_ARG;
+		/* fall through */
+	case COMMS_STAGE_ARG:
+		// Append to the argument until we reach its end.
+		if (!Comms_IsTokenEnd(c)) {
+			if (!Comms_AppendByte(b))
+				break;
+			return;
+		}
+		
+		if (!Comms_AppendByte('\0'))
+			break;
+		
+		comms_rx_nargs++;
+		comms_stage = COMMS_STAGE_NEWARG;
+		if (Comms_IsCommandEnd(c))
+			goto endcmd;
+		return;
+	case COMMS_STAGE_CRC:
+		// Parse the 2 hexadecimal digits of the CRC.
+		if (hexdigit(c) < 0)
+			break;
+		
+		comms_rx_frame_crc = (comms_rx_frame_crc << 4) | hexdigit(c);
+		if (++comms_tok_len == 2)
+			comms_stage = COMMS_STAGE_CRC_END;
+		return;
+	case COMMS_STAGE_CRC_END:
+		// Wait for the end of the frame.
+		if (c == '\r')
+			return;
+		if (c != '\n')
+			break;
+		
+		// Make sure the frame wasn't corrupted along the way.
+		if (comms_rx_frame_crc != comms_rx_crc) {
+			comms_stats.rejected++;
+			goto discard;
+		}
+		
+		comms_rx_frame->crc = true;
+		goto finished;
+	case COMMS_STAGE_BIN_ADDR:
+		comms_rx_addr = b;
+		comms_rx_crc = CRC8_Update(comms_rx_crc, b);
+		comms_stage = (comms_rx_has_seq) ? COMMS_STAGE_BIN_SEQ :
+			COMMS_STAGE_BIN_OPCODE;
+		return;
+	case COMMS_STAGE_BIN_SEQ:
+		comms_rx_seq = b;
+		comms_rx_crc = CRC8_Update(comms_rx_crc, b);
+		comms_stage = COMMS_STAGE_BIN_OPCODE;
+		return;
+	case COMMS_STAGE_BIN_OPCODE:
+		comms_rx_opcode = b;
+		comms_rx_crc = CRC8_Update(comms_rx_crc, b);
+		comms_stage = COMMS_STAGE_BIN_LEN;
+		return;
+	case COMMS_STAGE_BIN_LEN:
+		comms_rx_crc = CRC8_Update(comms_rx_crc, b);
+		comms_tok_len = b;
+		
+		// Skip over the whole frame if it isn't for us.
+		if (b > COMMS_BIN_PAYLOAD_MAX)
+			comms_stats.overlength++;
+		if ((b > COMMS_BIN_PAYLOAD_MAX) || !Comms_StartFrame(true)) {
+			comms_stage = COMMS_STAGE_BIN_SKIP;
+			return;
+		}
+		
+		comms_stage = (b > 0) ? COMMS_STAGE_BIN_PAYLOAD :
+			COMMS_STAGE_BIN_CHECKSUM;
+		return;
+	case COMMS_STAGE_BIN_PAYLOAD:
+		Comms_AppendByte(b);
+		comms_rx_crc = CRC8_Update(comms_rx_crc, b);
+		if (--comms_tok_len == 0)
+			comms_stage = COMMS_STAGE_BIN_CHECKSUM;
+		return;
+	case COMMS_STAGE_BIN_CHECKSUM:
+		// Make sure the frame wasn't corrupted along the way.
+		if (b != comms_rx_crc) {
+			comms_stats.rejected++;
+			goto discard;
+		}
+		
+		goto finished;
+	case COMMS_STAGE_BIN_SKIP:
+		// Skip the payload and the checksum without looking for the start of
+		// a frame in them. (Counting the checksum in LEN would wrap at 255)
+		if (comms_tok_len-- == 0)
+			comms_stage = COMMS_STAGE_READY;
+		return;
+	}
 	
-	// Append the received character to our buffer.
-	comms_rcv_buf[comms_ch_rcvd++] = c;
+	// Malformed frame.
+	comms_stats.parse_errors++;
+
+discard:
+	// Forget about the frame.
+	comms_stage = COMMS_STAGE_READY;
+	return;
+
+endcmd:
+	// Check the CRC before publishing the frame.
+	if (c == COMMS_CRC_MARK) {
+		comms_rx_frame_crc = 0;
+		comms_tok_len = 0;
+		comms_stage = COMMS_STAGE_CRC;
+		return;
+	}
 	
-	// Looks like a frame is ready for parsing.
-	if (c == '\n') {
-		comms_rcv_buf[comms_ch_rcvd] = '\0';
-		comms_frame_parse_rdy = true;
+	// Separate this command from the next one in the frame.
+	if (c == COMMS_BATCH_SEP) {
+		if (!Comms_AppendByte('\0'))
+			comms_stage = COMMS_STAGE_READY;
+		else
+			comms_stage = COMMS_STAGE_NEWCMD;
+		return;
 	}
+
+finished:
+	// Publish the frame to the main loop.
+	comms_stats.our_frames++;
+	comms_rcv_head++;
+	comms_stage = COMMS_STAGE_READY;
+}
+
+/**
+ * Checks if an address is ours, a broadcast or a group that we are part of.
+ * 
+ * @param  addr Address to be checked.
+ * @return      TRUE if we should handle frames sent to this address.
+ */
+static bool Comms_IsForUs(uint8_t addr) {
+	if ((addr == 0) || (addr == Config_GetOurAddress()))
+		return true;
+	if (addr < COMMS_GROUP_ADDR_BASE)
+		return false;
+	
+	return (Config_GetGroups() >> (addr - COMMS_GROUP_ADDR_BASE)) & 1;
 }
 
 /**
- * Something bad happened, so let's just completely discard any stored frames.
+ * Checks if the frame that's being received is for us and reserves a slot in
+ * the frame queue for it.
+ * 
+ * @param  binary Is this a binary frame?
+ * @return        FALSE if the frame should be dropped.
+ */
+static bool Comms_StartFrame(bool binary) {
+	volatile comms_rx_frame_t *frame;
+	
+	// Is this message for us?
+	if (!Comms_IsForUs(comms_rx_addr))
+		return false;
+	
+	// Make sure we have somewhere to store the frame.
+	if ((uint8_t)(comms_rcv_head - comms_rcv_tail) == FRAME_QUEUE_LEN) {
+		comms_stats.dropped++;
+		return false;
+	}
+	
+	// Start filling up the next free slot.
+	frame = &comms_rcv_frames[comms_rcv_head & FRAME_QUEUE_MASK];
+	frame->addr = comms_rx_addr;
+	frame->binary = binary;
+	frame->opcode = comms_rx_opcode;
+	frame->crc = binary;
+	frame->has_seq = comms_rx_has_seq;
+	frame->seq = comms_rx_seq;
+	frame->len = 0;
+	frame->baud_gen = comms_baud_gen;
+	comms_rx_frame = frame;
+	
+	return true;
+}
+
+/**
+ * Appends a received decimal digit to a number that's being parsed.
+ * 
+ * @param  n Number being parsed.
+ * @param  c Received digit.
+ * @return   FALSE if the number would overflow.
+ */
+static bool Comms_AppendDigit(volatile uint8_t *n, char c) {
+	uint16_t val = (*n * 10) + (c - '0');
+	
+	if (val > 255)
+		return false;
+	
+	*n = (uint8_t)val;
+	comms_tok_len++;
+	
+	return true;
+}
+
+/**
+ * Checks if a character ends the token that's currently being parsed.
+ * 
+ * @param  c Received character.
+ * @return   TRUE if the character is a delimiter.
+ */
+static bool Comms_IsTokenEnd(char c) {
+	return (c == ' ') || (c == '\r') || Comms_IsCommandEnd(c);
+}
+
+/**
+ * Checks if a character ends the command that's currently being parsed.
+ * 
+ * @param  c Received character.
+ * @return   TRUE if the character ends the command.
+ */
+static bool Comms_IsCommandEnd(char c) {
+	return (c == '\n') || (c == COMMS_BATCH_SEP) || (c == COMMS_CRC_MARK);
+}
+
+/**
+ * Appends a received byte to the frame that's currently being received.
+ * 
+ * @param  b Byte to be appended.
+ * @return   FALSE if the frame would overflow its buffer.
+ */
+static bool Comms_AppendByte(uint8_t b) {
+	volatile comms_rx_frame_t *frame = comms_rx_frame;
+	
+	if (frame->len == FRAME_MAX_LEN) {
+		comms_stats.overlength++;
+		return false;
+	}
+	
+	frame->buf[frame->len++] = (char)b;
+	return true;
+}
+
+/**
+ * Sets the baud rate that we'll switch to when the master commits it.
+ * 
+ * @param  baud Baud rate from the uart_baud_t enum.
+ * @return      FALSE if the baud rate isn't supported.
+ */
+bool Comms_SetPendingBaudRate(uint8_t baud) {
+	if (baud >= UART_BAUD_NUM)
+		return false;
+	
+	comms_pending_baud = baud;
+	return true;
+}
+
+/**
+ * Gets the baud rate that we'll switch to when the master commits it.
+ * 
+ * @return Baud rate from the uart_baud_t enum or BAUD_NONE.
+ */
+uint8_t Comms_GetPendingBaudRate(void) {
+	return comms_pending_baud;
+}
+
+/**
+ * Switches over to the pending baud rate after the frame that's being handled
+ * has been replied to, so the whole reply (even of a batch frame) goes out at
+ * the old baud rate. If no valid frame is received before
+ * BAUD_FALLBACK_TIMEOUT expires we'll go back to the baud rate that's stored
+ * in the EEPROM.
+ * 
+ * @return FALSE if there was no pending baud rate to switch to.
+ */
+bool Comms_CommitBaudRate(void) {
+	if (comms_pending_baud == BAUD_NONE)
+		return false;
+	
+	comms_baud_commit = true;
+	return true;
+}
+
+/**
+ * Switches over to the baud rate that was committed. Anything already queued
+ * up is sent at the old baud rate.
+ */
+static void Comms_SwitchBaudRate(void) {
+	comms_baud_commit = false;
+	UART_Initialize(comms_pending_baud);
+	comms_pending_baud = BAUD_NONE;
+	comms_baud_gen++;
+	
+	// Start the fallback timer.
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		comms_baud_expired = false;
+		RTC_Timer_Restart(&comms_baud_timer);
+	}
+}
+
+/**
+ * Keeps track of time for the bus communication stuff. Should be called from
+ * the RTC period interrupt.
+ */
+void Comms_Tick(void) {
+	if (RTC_Timer_Tick(&comms_baud_timer))
+		comms_baud_expired = true;
+}
+
+/**
+ * Something bad happened, so let's just discard the frame being received.
+ * Frames that are already queued up are left untouched.
  */
 void Comms_DiscardFrame(void) {
-	// Discard the parsed frame.
-	comms_rcv_frame.addr = 0;
-	comms_rcv_frame.command[0] = '\0';
-	comms_rcv_frame.num_args = 0;
+	Comms_ResetRXBuffer();
+}
+
+/**
+ * Handles a character that was received with errors, which also means that
+ * any announcement that we are sending has collided with someone else's.
+ * 
+ * @param flags Error flags from the USART RXDATAH register.
+ */
+void Comms_ReceiveError(uint8_t flags) {
+	if (flags & USART_FERR_bm)
+		comms_stats.framing_errors++;
+	if (flags & USART_PERR_bm)
+		comms_stats.parity_errors++;
+	if (flags & USART_BUFOVF_bm)
+		comms_stats.overruns++;
+	
+	// Any announcement that we were sending has collided.
+	comms_last_rx_tick = RTC_GetTicks();
+	if (comms_annc_state == COMMS_ANNC_SENDING)
+		comms_annc_collided = true;
 	
-	// Reset the character counter and frame string buffer.
 	Comms_ResetRXBuffer();
 }
 
 /**
- * Resets the receive buffer stuff.
+ * Resets the receive state machine, discarding the frame that's currently
+ * being received.
  */
 void Comms_ResetRXBuffer(void) {
-	comms_rcv_buf[0] = '\0';
-	comms_ch_rcvd = 0;
-	comms_frame_parse_rdy = false;
+	comms_stage = COMMS_STAGE_READY;
+}
+
+/**
+ * Gets a snapshot of the bus statistics.
+ * 
+ * @param stats Statistics structure to be populated.
+ */
+void Comms_GetStats(comms_stats_t *stats) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		memcpy(stats, (const void *)&comms_stats, sizeof(comms_stats_t));
+	}
+}
+
+/**
+ * Resets all of the bus statistics.
+ */
+void Comms_ResetStats(void) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		memset((void *)&comms_stats, 0, sizeof(comms_stats_t));
+	}
 }
 
 /**
@@ -229,26 +1164,26 @@ void Comms_DebugPrintFrame(void) {
 	
 	// Address
 	UART_SendString("Address: ");
-	u8toa(nch, comms_rcv_frame.addr);
+	u8toa(nch, comms_cur_frame->addr);
 	UART_SendString(nch);
 	UART_SendString("\r\n");
 	
 	// Command
 	UART_SendString("Command: '");
-	UART_SendString(comms_rcv_frame.command);
+	UART_SendString(comms_cur_frame->command);
 	UART_SendLine("'");
 	
 	// Arguments
 	UART_SendString("Arguments [");
-	u8toa(nch, comms_rcv_frame.num_args);
+	u8toa(nch, comms_cur_frame->num_args);
 	UART_SendString(nch);
 	UART_SendLine("]:");
-	for (uint8_t i = 0; i < comms_rcv_frame.num_args; i++) {
+	for (uint8_t i = 0; i < comms_cur_frame->num_args; i++) {
 		UART_SendString("  [");
 		u8toa(nch, i);
 		UART_SendString(nch);
 		UART_SendString("] '");
-		UART_SendString(comms_rcv_frame.args[i]);
+		UART_SendString(comms_cur_frame->args[i]);
 		UART_SendLine("'");
 	}
 	
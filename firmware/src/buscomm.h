@@ -16,26 +16,156 @@ extern "C" {
 #include <stdbool.h>
 	
 // Some definitions.
-#define FRAME_MAX_LEN 250
-#define ARG_MAX_LEN   15
-#define ARGS_MAX      5
+#define ARGS_MAX        6   // Per command.
+#define FRAME_MAX_LEN   64  // All of the tokens in a frame including NULs.
+#define FRAME_QUEUE_LEN 2   // Must be a power of 2.
+#define BAUD_FALLBACK_TIMEOUT 10  // RTC periods without frames after a switch.
+#define BAUD_NONE             0xFF
 
-// Frame of data.
+/*
+ * Addresses from COMMS_GROUP_ADDR_BASE up are group addresses, so a frame sent
+ * to COMMS_GROUP_ADDR_BASE + n is handled by every node that's a member of
+ * group n. Like broadcasts, setters don't reply to group frames, but queries
+ * do. Those replies carry the node's own address and go out in the same
+ * collision-avoiding slots as announcements. A reply longer than
+ * ANNC_MSG_MAX_LEN is replaced by an OVERFLOW error, so queries with long
+ * replies (like STATS? or EVLOG) must be sent to each node on its own.
+ */
+#define COMMS_GROUP_ADDR_BASE 0xF0
+#define COMMS_GROUPS_NUM      16
+
+/*
+ * ASCII frames may carry several commands separated by COMMS_BATCH_SEP, as in
+ * ":5 WBIDLCOLOR 0 0 10|ANNCPRESS 1|WBARM\r\n". Every command in the frame is
+ * checked before any of them is run, so a frame with an invalid command is
+ * rejected as a whole, and the replies of all the commands are combined into a
+ * single line using the same separator.
+ */
+#define COMMS_BATCH_SEP '|'
+
+/*
+ * Frames may optionally carry a sequence number, as in ":5@42 CLKCAL+\r\n" or
+ * by using COMMS_BIN_SYNC_SEQ with a SEQ byte right after ADDR in binary
+ * frames. A frame with the same sequence number as the last one is a
+ * retransmission, so it isn't run again and, if it was sent only to us, gets
+ * the cached reply of the original instead. Frames whose reply didn't fit in
+ * the cache are run again, so commands with long replies must be safe to
+ * repeat.
+ */
+#define COMMS_SEQ_MARK        '@'
+#define COMMS_REPLY_CACHE_LEN 48  // Including the NUL terminator.
+
+/*
+ * Unsolicited messages (announcements) and group replies are only sent after
+ * the bus has been idle for BUS_IDLE_GAP ticks plus our own backoff slot.
+ * Slots are derived from a different set of bits of our address on each
+ * attempt, so two nodes that collide once will end up in different slots
+ * within a few retries. Our own transmission is read back to detect
+ * collisions, which requires the RS-485 receiver to stay enabled while we
+ * transmit. If we don't hear a single byte of our own echo the receiver is
+ * assumed to be gated by TX_EN and the transmission to have gone through, but
+ * an echo that's cut short counts as a collision.
+ * 
+ * Worst case latency per message is roughly:
+ *   ANNC_ATTEMPTS * (BUS_IDLE_GAP + (ANNC_SLOTS - 1) * ANNC_SLOT_TICKS + msg)
+ */
+#define BUS_IDLE_GAP     3   // RTC ticks.
+#define ANNC_SLOTS       8   // Must be 8 since slots come from 3 address bits.
+#define ANNC_SLOT_TICKS  2   // RTC ticks.
+#define ANNC_ATTEMPTS    4
+#define ANNC_MSG_MAX_LEN 40  // Including the reply header and CRLF.
+#define ANNC_SLOT_AUTO   0xFF  // Slot derived from our address, with retries.
+
+/*
+ * Binary frames are an alternative to the ASCII ":addr CMD args\r\n" frames
+ * and are laid out as:
+ * 
+ *   SYNC ADDR OPCODE LEN PAYLOAD[LEN] CHK
+ *   SYNC_SEQ ADDR SEQ OPCODE LEN PAYLOAD[LEN] CHK
+ * 
+ * Where CHK is the CRC-8 of every byte from ADDR up to the end of the payload.
+ * Each argument is a single raw byte in the payload.
+ * 
+ * ASCII frames may optionally end with a COMMS_CRC_MARK followed by the CRC-8
+ * of everything from the ':' up to the mark in 2 hexadecimal digits, as in
+ * ":5 WBARM*XX\r\n". Frames that fail the check are dropped and counted. The
+ * replies to frames that carried a CRC (including all binary ones) carry one
+ * as well, calculated from the ';' up to the mark.
+ */
+#define COMMS_BIN_SYNC        0xA5
+#define COMMS_BIN_SYNC_SEQ    0xA6
+#define COMMS_CRC_MARK        '*'
+#define COMMS_BIN_PAYLOAD_MAX FRAME_MAX_LEN
+
+// Received frame as it's stored in the queue. Tokens are NUL terminated and
+// commands are separated by an empty token.
+typedef struct {
+	uint8_t addr;
+	bool binary;
+	uint8_t opcode;
+	bool crc;
+	bool has_seq;
+	uint8_t seq;
+	uint8_t len;
+	uint8_t baud_gen;         // Baud rate switches before it started arriving.
+	char buf[FRAME_MAX_LEN];  // Raw payload for binary frames.
+} comms_rx_frame_t;
+
+// Single command of a frame.
 typedef struct {
 	uint8_t addr;
-	char command[ARG_MAX_LEN + 1];
-	char args[ARGS_MAX][ARG_MAX_LEN + 1];
-	uint8_t num_args;
+	bool binary;
+	uint8_t opcode;
+	bool crc;
+	bool has_seq;
+	bool repeat;                 // Retransmission that's being handled again.
+	const char *command;
+	const char *args[ARGS_MAX];  // Raw payload in the first one for binary frames.
+	uint8_t num_args;            // Payload length for binary frames.
 } comms_frame_t;
 
+// Bus statistics. (All uint16_t so they can be reported in order)
+typedef struct {
+	uint16_t rx_frames;       // Frame starts seen on the bus.
+	uint16_t our_frames;      // Frames for us that were queued up.
+	uint16_t rx_bytes;
+	uint16_t replies;
+	uint16_t framing_errors;
+	uint16_t parity_errors;
+	uint16_t overruns;
+	uint16_t parse_errors;    // Malformed frames including overlength ones.
+	uint16_t overlength;
+	uint16_t dropped;         // Frame queue was full.
+	uint16_t rejected;        // Failed the CRC check.
+	uint16_t duplicates;
+	uint16_t annc_failed;
+} comms_stats_t;
+
+// Announcement states.
+typedef enum {
+	COMMS_ANNC_IDLE,
+	COMMS_ANNC_WAITING,
+	COMMS_ANNC_SENDING
+} comms_annc_state_t;
+
 // Command parsing stages.
 typedef enum {
 	COMMS_STAGE_READY,
 	COMMS_STAGE_ADDR,
+	COMMS_STAGE_SEQ,
+	COMMS_STAGE_NEWCMD,
 	COMMS_STAGE_COMMAND,
 	COMMS_STAGE_NEWARG,
 	COMMS_STAGE_ARG,
-	COMMS_STAGE_FINISHED
+	COMMS_STAGE_CRC,
+	COMMS_STAGE_CRC_END,
+	COMMS_STAGE_BIN_ADDR,
+	COMMS_STAGE_BIN_SEQ,
+	COMMS_STAGE_BIN_OPCODE,
+	COMMS_STAGE_BIN_LEN,
+	COMMS_STAGE_BIN_PAYLOAD,
+	COMMS_STAGE_BIN_CHECKSUM,
+	COMMS_STAGE_BIN_SKIP
 } comms_stage_t;
 
 // Initialization
@@ -44,8 +174,17 @@ void Comms_Initialize(uint8_t addr);
 // Receiving
 void Comms_ReceiveChar(char c);
 void Comms_ParseFrame(void);
+bool Comms_IsBusIdle(void);
+bool Comms_IsFramePending(void);
+bool Comms_IsReceiving(void);
+bool Comms_IsAnnouncing(void);
+bool Comms_IsUnicast(const comms_frame_t *frame);
+void Comms_ReceiveError(uint8_t flags);
+uint8_t Comms_GetArgU8(const comms_frame_t *frame, uint8_t index);
+int8_t Comms_GetArgI8(const comms_frame_t *frame, uint8_t index);
 
 // External Handlers
+extern bool Comms_CheckCommand(const comms_frame_t *frame);
 extern void Comms_HandleCommand(const comms_frame_t *frame);
 
 // Replying
@@ -54,11 +193,23 @@ void Comms_ReplyStart(void);
 void Comms_ReplyEnd(void);
 void Comms_AddrReply(uint8_t addr, const char *reply);
 void Comms_Reply(const char *reply);
+bool Comms_Announce(const char *msg);
+void Comms_HoldReply(uint8_t slot);
+
+// Baud Rate Negotiation
+bool Comms_SetPendingBaudRate(uint8_t baud);
+uint8_t Comms_GetPendingBaudRate(void);
+bool Comms_CommitBaudRate(void);
+void Comms_Tick(void);
 
 // Error Handling
 void Comms_ResetRXBuffer(void);
 void Comms_DiscardFrame(void);
 
+// Statistics
+void Comms_GetStats(comms_stats_t *stats);
+void Comms_ResetStats(void);
+
 // Getters and Setters
 void Comms_SetOurAddress(uint8_t addr, bool persist);
 const char* Comms_GetAddrStr(void);
@@ -0,0 +1,97 @@
+/**
+ * button.c
+ * Debounced wall switch handling.
+ * 
+ * Every edge of the switch (re)starts a debounce timer that's ticked by the
+ * RTC PIT. Once the switch has been stable for BUTTON_DEBOUNCE_TICKS we compare
+ * its level to the last debounced state and emit a single event stamped with
+ * the tick of the first edge of the actuation.
+ * 
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include "button.h"
+#include <avr/io.h>
+#include "pins.h"
+#include "rtc.h"
+#include "events.h"
+
+// Private variables.
+static rtc_timer_t btn_debounce_timer;
+static volatile uint16_t btn_edge_tick;
+static volatile bool btn_pressed;
+static volatile bool btn_release_events;
+
+/**
+ * Initializes the wall switch input and its debouncing.
+ */
+void Button_Initialize(void) {
+	RTC_Timer_Setup(&btn_debounce_timer, false, BUTTON_DEBOUNCE_TICKS);
+	btn_pressed = !(PORTC.IN & WALL_SW);
+	
+	// Trigger on both edges. (PC2 is fully asynchronous so this also wakes us)
+	PORTC.PIN2CTRL = PORT_ISC_BOTHEDGES_gc;
+}
+
+/**
+ * Checks if the button is currently pressed.
+ * 
+ * @return Debounced state of the button.
+ */
+bool Button_IsPressed(void) {
+	return btn_pressed;
+}
+
+/**
+ * Sets whether we should also emit an event when the button is released.
+ * 
+ * @param enable Emit release events?
+ */
+void Button_SetReleaseEvents(bool enable) {
+	btn_release_events = enable;
+}
+
+/**
+ * Checks whether we are emitting events when the button is released.
+ * 
+ * @return Are release events enabled?
+ */
+bool Button_GetReleaseEvents(void) {
+	return btn_release_events;
+}
+
+/**
+ * Handles an edge of the wall switch. Should be called from the pin change
+ * interrupt.
+ */
+void Button_HandleEdge(void) {
+	// Timestamp the actuation with its first edge.
+	if (!btn_debounce_timer.enabled)
+		btn_edge_tick = RTC_GetTicks();
+	
+	RTC_Timer_Restart(&btn_debounce_timer);
+}
+
+/**
+ * Advances the debouncing timer. Should be called from the PIT interrupt.
+ */
+void Button_Tick(void) {
+	bool pressed;
+	
+	// Wait for the switch to settle down.
+	if (!RTC_Timer_Tick(&btn_debounce_timer))
+		return;
+	
+	// Check if this was an actual change in the switch state.
+	pressed = !(PORTC.IN & WALL_SW);
+	if (pressed == btn_pressed)
+		return;
+	btn_pressed = pressed;
+	
+	// Let everyone know about it.
+	if (pressed) {
+		Event_Push(EVENT_PRESS, btn_edge_tick);
+	} else if (btn_release_events) {
+		Event_Push(EVENT_RELEASE, btn_edge_tick);
+	}
+}
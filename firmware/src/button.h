@@ -0,0 +1,37 @@
+/**
+ * button.h
+ * Debounced wall switch handling.
+ * 
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef BUTTON_H
+#define	BUTTON_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+// Some definitions.
+#define BUTTON_DEBOUNCE_TICKS 5  // RTC ticks the switch must be stable for.
+	
+// Initialization
+void Button_Initialize(void);
+
+// State
+bool Button_IsPressed(void);
+void Button_SetReleaseEvents(bool enable);
+bool Button_GetReleaseEvents(void);
+
+// Interrupt Handlers
+void Button_HandleEdge(void);
+void Button_Tick(void);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* BUTTON_H */
@@ -0,0 +1,97 @@
+/**
+ * commands.h
+ * Declarative table of all the commands that we understand.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef COMMANDS_H
+#define	COMMANDS_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <avr/io.h>
+#include <inttypes.h>
+#include "buscomm.h"
+#include "profile.h"
+
+// Command flags.
+#define CMD_FLAG_PROG _BV(0)  // Only accepted while the wall switch is held.
+
+// Command handler function.
+typedef void (*cmd_handler_t)(const comms_frame_t *frame);
+
+// Command table entry.
+typedef struct {
+	const char *name;
+	cmd_handler_t handler;
+	uint8_t min_args;
+	uint8_t flags;
+} command_t;
+
+// Profiling commands. (Only available when profiling is enabled)
+#ifdef PROF_ENABLED
+#define PROF_COMMANDS \
+	COMMAND(PROF_GET,        "PROF?",        0x26, Cmd_GetProfile,         1, 0)             \
+	COMMAND(PROFRST,         "PROFRST",      0x27, Cmd_ResetProfile,       0, 0)
+#else
+#define PROF_COMMANDS
+#endif
+
+/**
+ * Table of commands as COMMAND(id, name, opcode, handler, min_args, flags)
+ * entries. This gets expanded into a table in flash that's binary searched, so
+ * it MUST be kept sorted by name in strcmp() order. The opcode is what
+ * identifies the command in binary frames and must be unique and never reused.
+ */
+#define COMMANDS_TABLE \
+	COMMAND(ANNCPRESS,       "ANNCPRESS",    0x09, Cmd_SetAnnouncePress,   1, 0)             \
+	COMMAND(ANNCPRESS_GET,   "ANNCPRESS?",   0x0A, Cmd_GetAnnouncePress,   0, 0)             \
+	COMMAND(ANNCRELEASE,     "ANNCRELEASE",  0x13, Cmd_SetAnnounceRelease, 1, 0)             \
+	COMMAND(ANNCRELEASE_GET, "ANNCRELEASE?", 0x14, Cmd_GetAnnounceRelease, 0, 0)             \
+	COMMAND(ASSIGN,          "ASSIGN",       0x28, Cmd_AssignAddress,      2, 0)             \
+	COMMAND(BAUD_GET,        "BAUD?",        0x12, Cmd_GetBaudRate,        0, 0)             \
+	COMMAND(BAUDCOMMIT,      "BAUDCOMMIT",   0x11, Cmd_CommitBaudRate,     0, 0)             \
+	COMMAND(BOOT,            "BOOT",         0x2B, Cmd_EnterBootloader,    2, 0)             \
+	COMMAND(CLKCAL_INC,      "CLKCAL+",      0x0C, Cmd_IncreaseClockCal,   0, CMD_FLAG_PROG) \
+	COMMAND(CLKCAL_DEC,      "CLKCAL-",      0x0D, Cmd_DecreaseClockCal,   0, CMD_FLAG_PROG) \
+	COMMAND(CLKCAL_GET,      "CLKCAL?",      0x0B, Cmd_GetClockCal,        0, 0)             \
+	COMMAND(ENUM,            "ENUM",         0x29, Cmd_Enumerate,          1, 0)             \
+	COMMAND(ENUMRST,         "ENUMRST",      0x2A, Cmd_ResetEnumeration,   0, 0)             \
+	COMMAND(EVLOG,           "EVLOG",        0x23, Cmd_DrainEventLog,      0, 0)             \
+	COMMAND(FXKEY,           "FXKEY",        0x19, Cmd_SetEffectKeyframe,  5, 0)             \
+	COMMAND(FXKEY_GET,       "FXKEY?",       0x1A, Cmd_GetEffectKeyframe,  1, 0)             \
+	COMMAND(FXLEN,           "FXLEN",        0x1B, Cmd_SetEffectLength,    1, 0)             \
+	COMMAND(FXLEN_GET,       "FXLEN?",       0x1C, Cmd_GetEffectLength,    0, 0)             \
+	COMMAND(FXPLAY,          "FXPLAY",       0x1D, Cmd_PlayEffect,         0, 0)             \
+	COMMAND(FXPLAY_GET,      "FXPLAY?",      0x1E, Cmd_GetEffectPlaying,   0, 0)             \
+	COMMAND(FXSTOP,          "FXSTOP",       0x1F, Cmd_StopEffect,         0, 0)             \
+	COMMAND(GROUPADD,        "GROUPADD",     0x20, Cmd_AddGroup,           1, 0)             \
+	COMMAND(GROUPDEL,        "GROUPDEL",     0x21, Cmd_RemoveGroup,        1, 0)             \
+	COMMAND(GROUPS_GET,      "GROUPS?",      0x22, Cmd_GetGroups,          0, 0)             \
+	COMMAND(PRESSED_GET,     "PRESSED?",     0x08, Cmd_GetPressed,         0, 0)             \
+	PROF_COMMANDS                                                                            \
+	COMMAND(SETADDR,         "SETADDR",      0x0E, Cmd_SetAddress,         1, CMD_FLAG_PROG) \
+	COMMAND(SETBAUD,         "SETBAUD",      0x10, Cmd_SetBaudRate,        1, 0)             \
+	COMMAND(SETCLKCAL,       "SETCLKCAL",    0x0F, Cmd_SetClockCal,        1, CMD_FLAG_PROG) \
+	COMMAND(SLEEP_GET,       "SLEEP?",       0x15, Cmd_GetSleepTime,       0, 0)             \
+	COMMAND(STATS_GET,       "STATS?",       0x24, Cmd_GetStats,           0, 0)             \
+	COMMAND(STATSRST,        "STATSRST",     0x25, Cmd_ResetStats,         0, 0)             \
+	COMMAND(WBACTCOLOR,      "WBACTCOLOR",   0x03, Cmd_SetActuatedColor,   3, 0)             \
+	COMMAND(WBACTCOLOR_GET,  "WBACTCOLOR?",  0x04, Cmd_GetActuatedColor,   0, 0)             \
+	COMMAND(WBARM,           "WBARM",        0x05, Cmd_Arm,                0, 0)             \
+	COMMAND(WBARM_GET,       "WBARM?",       0x06, Cmd_GetArmed,           0, 0)             \
+	COMMAND(WBFADE,          "WBFADE",       0x16, Cmd_Fade,               4, 0)             \
+	COMMAND(WBFADETIME,      "WBFADETIME",   0x17, Cmd_SetFadeTime,        1, 0)             \
+	COMMAND(WBFADETIME_GET,  "WBFADETIME?",  0x18, Cmd_GetFadeTime,        0, 0)             \
+	COMMAND(WBIDLCOLOR,      "WBIDLCOLOR",   0x01, Cmd_SetIdleColor,       3, 0)             \
+	COMMAND(WBIDLCOLOR_GET,  "WBIDLCOLOR?",  0x02, Cmd_GetIdleColor,       0, 0)             \
+	COMMAND(WHAT_GET,        "WHAT?",        0x07, Cmd_What,               0, 0)
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* COMMANDS_H */
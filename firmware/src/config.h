@@ -21,19 +21,29 @@ FUSES = {
 	.SYSCFG0 = 0xF6, // SYSCFG0 {EESAVE=CLEAR, RSTPINCFG=UPDI, CRCSRC=NOCRC}
 	.SYSCFG1 = 0xFF, // SYSCFG1 {SUT=64MS}
 	.APPEND = 0x00, // APPEND {APPEND=User range:  0x0 - 0xFF}
-	.BOOTEND = 0x00, // BOOTEND {BOOTEND=User range:  0x0 - 0xFF}
+	.BOOTEND = 0x04, // BOOTEND {BOOTEND=User range:  0x0 - 0xFF}
 };
 
 LOCKBITS = 0xC5; // {LB=NOLOCK}
 
+// Size of the bootloader section. (BOOTEND * 256, the application starts here)
+#define BOOT_SECTION_SIZE 0x400
+
+// Arguments that BOOT must carry, so a stray frame can't reset us. (0xB007)
+#define BOOT_MAGIC_HI 176
+#define BOOT_MAGIC_LO 7
+
 // Just making sure.
 #ifndef F_CPU
 #error "F_CPU not defined"
 #endif
 
-// Bus default baud rate.
-//#define BUS_BAUD_RATE 38400
-#define BUS_BAUD_RATE 9600
+// Bus default baud rate. (Used when the EEPROM doesn't have a valid one)
+//#define BUS_BAUD_RATE UART_BAUD_38400
+#define BUS_BAUD_RATE UART_BAUD_9600
+
+// Default time to transition between the idle and actuated colors in ms.
+#define DEFAULT_FADE_TIME 250
 
 #ifdef	__cplusplus
 }
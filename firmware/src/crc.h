@@ -0,0 +1,27 @@
+/**
+ * crc.h
+ * CRC-8 calculation for frame integrity checks.
+ * 
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef CRC_H
+#define	CRC_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <inttypes.h>
+	
+// Some definitions.
+#define CRC8_INIT 0x00
+
+// Calculation
+uint8_t CRC8_Update(uint8_t crc, uint8_t b);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* CRC_H */
@@ -0,0 +1,86 @@
+/**
+ * effects.c
+ * Keyframe animation interpreter for programs stored in EEPROM.
+ * 
+ * A program is a list of keyframes, each one being a color that we fade to
+ * using the fade engine, and a loop count where 0 means forever.
+ * 
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include "effects.h"
+#include <avr/io.h>
+#include "nvmconfig.h"
+
+// Private variables.
+static bool fx_running;
+static uint8_t fx_index;
+static uint8_t fx_loops_left;
+
+/**
+ * Starts playing the program stored in EEPROM from the beginning.
+ * 
+ * @return FALSE if there's no program to play.
+ */
+bool Effect_Start(void) {
+	if (Config_GetEffectLength() == 0)
+		return false;
+	
+	fx_index = 0;
+	fx_loops_left = Config_GetEffectLoops();
+	fx_running = true;
+	
+	return true;
+}
+
+/**
+ * Stops playing the program, leaving the current color as it is.
+ */
+void Effect_Stop(void) {
+	fx_running = false;
+}
+
+/**
+ * Checks if a program is currently being played.
+ * 
+ * @return TRUE if a program is playing.
+ */
+bool Effect_IsRunning(void) {
+	return fx_running;
+}
+
+/**
+ * Checks if the program is waiting for the main loop to start its next
+ * keyframe.
+ * 
+ * @return TRUE if Effect_Task() has work to do.
+ */
+bool Effect_IsWaiting(void) {
+	return fx_running && !PWM_IsFading();
+}
+
+/**
+ * Starts the next keyframe once the previous one has finished. Should be
+ * called from the main loop.
+ */
+void Effect_Task(void) {
+	fx_keyframe_t kf;
+	
+	// Check if we have anything to do.
+	if (!Effect_IsWaiting())
+		return;
+	
+	// Go back to the beginning of the program or stop at the end of it.
+	if (fx_index >= Config_GetEffectLength()) {
+		if ((fx_loops_left > 0) && (--fx_loops_left == 0)) {
+			fx_running = false;
+			return;
+		}
+		
+		fx_index = 0;
+	}
+	
+	// Fade to the next keyframe.
+	Config_GetEffectKeyframe(fx_index++, &kf);
+	PWM_FadeToColorEase(kf.color, kf.time * FX_TIME_UNIT_MS, kf.easing);
+}
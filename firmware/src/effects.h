@@ -0,0 +1,41 @@
+/**
+ * effects.h
+ * Keyframe animation interpreter for programs stored in EEPROM.
+ * 
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef EFFECTS_H
+#define	EFFECTS_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "pwm.h"
+	
+// Some definitions.
+#define FX_KEYFRAMES_MAX 8
+#define FX_TIME_UNIT_MS  10  // Keyframe durations are in these units.
+
+// Keyframe structure.
+typedef struct {
+	rgb_t color;
+	uint8_t time;
+	uint8_t easing;
+} fx_keyframe_t;
+	
+// Playback
+bool Effect_Start(void);
+void Effect_Stop(void);
+bool Effect_IsRunning(void);
+bool Effect_IsWaiting(void);
+void Effect_Task(void);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* EFFECTS_H */
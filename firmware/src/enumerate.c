@@ -0,0 +1,105 @@
+/**
+ * enumerate.c
+ * Discovery and address assignment of nodes by their serial number.
+ * 
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include "enumerate.h"
+#include <avr/io.h>
+#include "nvmconfig.h"
+#include "strutils.h"
+
+// Serial number in the signature row.
+#define ENUM_SERIAL ((const volatile uint8_t *)&SIGROW.SERNUM0)
+
+// Private variables.
+static bool enum_active = false;
+
+// Private methods.
+static uint8_t Enum_SerialBit(uint8_t index);
+
+/**
+ * Starts a new enumeration session.
+ * 
+ * @param all Should nodes that already have an assigned address take part?
+ */
+void Enum_Reset(bool all) {
+	enum_active = all || !Config_GetFlag(CONFIG_FLAG_ADDR_SET);
+}
+
+/**
+ * Stops taking part in the current enumeration session.
+ */
+void Enum_Leave(void) {
+	enum_active = false;
+}
+
+/**
+ * Checks if we should answer an enumeration query.
+ * 
+ * @param  bits   Number of bits of the prefix to match.
+ * @param  prefix Serial number prefix, most significant bit first.
+ * @return        Slot to reply in or -1 if we shouldn't reply.
+ */
+int8_t Enum_Match(uint8_t bits, const uint8_t *prefix) {
+	uint8_t slot = 0;
+	uint8_t i;
+	
+	if (!enum_active || (bits > ENUM_SERIAL_BITS))
+		return -1;
+	
+	// Check the prefix.
+	for (i = 0; i < bits; i++) {
+		if (Enum_SerialBit(i) != ((prefix[i / 8] >> (7 - (i % 8))) & 1))
+			return -1;
+	}
+	
+	// Our slot comes from the bits right after it.
+	for (i = bits; i < (bits + ENUM_SLOT_BITS); i++) {
+		slot <<= 1;
+		if (i < ENUM_SERIAL_BITS)
+			slot |= Enum_SerialBit(i);
+	}
+	
+	return slot;
+}
+
+/**
+ * Checks if a serial number is ours.
+ * 
+ * @param  serial Serial number with ENUM_SERIAL_LEN bytes.
+ * @return        TRUE if it's our serial number.
+ */
+bool Enum_IsOurSerial(const uint8_t *serial) {
+	uint8_t i;
+	
+	for (i = 0; i < ENUM_SERIAL_LEN; i++) {
+		if (serial[i] != ENUM_SERIAL[i])
+			return false;
+	}
+	
+	return true;
+}
+
+/**
+ * Gets our serial number as a hexadecimal string.
+ * 
+ * @param buf Buffer with space for ENUM_SERIAL_LEN * 2 characters plus NUL.
+ */
+void Enum_GetSerialStr(char *buf) {
+	uint8_t i;
+	
+	for (i = 0; i < ENUM_SERIAL_LEN; i++)
+		u8tohex(buf + (i * 2), ENUM_SERIAL[i]);
+}
+
+/**
+ * Gets a single bit of our serial number.
+ * 
+ * @param  index Index of the bit, starting from the most significant one.
+ * @return       Value of the bit.
+ */
+static uint8_t Enum_SerialBit(uint8_t index) {
+	return (ENUM_SERIAL[index / 8] >> (7 - (index % 8))) & 1;
+}
@@ -0,0 +1,52 @@
+/**
+ * enumerate.h
+ * Discovery and address assignment of nodes by their serial number.
+ * 
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef ENUMERATE_H
+#define	ENUMERATE_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+/*
+ * Every node has a unique 80-bit serial number in its signature row, which is
+ * used to find the nodes on a bus without pressing their wall switches. The
+ * master starts a session with a broadcast ENUMRST, which makes every node
+ * without an assigned address take part in it. (Or every node with ENUMRST 1)
+ * 
+ * A broadcast "ENUM bits prefix" is answered by every node in the session
+ * whose serial starts with the first bits of the hex prefix. They reply with
+ * "ENUM slot serial" in the slot picked by the next ENUM_SLOT_BITS bits of
+ * their serial, and since replies in different slots go out one after the
+ * other, a clean reply is a single node that can be given an address straight
+ * away with a broadcast "ASSIGN addr serial", which also takes it out of the
+ * session. A garbled reply means that several nodes share that slot, so the
+ * master asks again with the slot's bits appended to the prefix. Clean replies
+ * carry their slot so the master never has to work out the branch from their
+ * timing alone.
+ */
+#define ENUM_SERIAL_LEN  10  // Bytes.
+#define ENUM_SERIAL_BITS (ENUM_SERIAL_LEN * 8)
+#define ENUM_SLOT_BITS   3   // Must match ANNC_SLOTS.
+
+// Session
+void Enum_Reset(bool all);
+void Enum_Leave(void);
+
+// Serial number
+int8_t Enum_Match(uint8_t bits, const uint8_t *prefix);
+bool Enum_IsOurSerial(const uint8_t *serial);
+void Enum_GetSerialStr(char *buf);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* ENUMERATE_H */
@@ -0,0 +1,184 @@
+/**
+ * events.c
+ * Queue of things that happened and still need to be taken care of.
+ * 
+ * Events are pushed from interrupts and popped from the main loop, so this is
+ * a lock-free single-producer single-consumer ring buffer. The same buffer
+ * doubles as a log of recent events that the master drains over the bus with
+ * its own cursor, which simply skips ahead whenever the log gets overwritten.
+ * Drained events are only held back until the master acknowledges them, so a
+ * reply that got lost on the bus can be asked for again.
+ * 
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include "events.h"
+#include <avr/io.h>
+#include <util/atomic.h>
+
+// Private definitions.
+#define EVENT_QUEUE_MASK (EVENT_QUEUE_LEN - 1)
+
+// Private variables.
+static volatile event_t event_queue[EVENT_QUEUE_LEN];
+static volatile uint8_t event_head;
+static volatile uint8_t event_tail;
+static volatile uint8_t event_log_tail;
+static volatile uint8_t event_log_held;
+static volatile uint8_t event_count;
+static volatile uint16_t event_dropped;
+static volatile uint16_t event_log_lost;
+
+/**
+ * Records an event in the queue. Must only be called from an interrupt.
+ * 
+ * @param  type      Type of the event from the event_type_t enum.
+ * @param  timestamp RTC tick when the event happened.
+ * @return           FALSE if the queue was full and the event got dropped.
+ */
+bool Event_Push(uint8_t type, uint16_t timestamp) {
+	volatile event_t *evt;
+	
+	// Check if we have space for another event.
+	if ((uint8_t)(event_head - event_tail) == EVENT_QUEUE_LEN) {
+		event_dropped++;
+		return false;
+	}
+	
+	// Make room in the log by forgetting its oldest event.
+	if ((uint8_t)(event_head - event_log_tail) == EVENT_QUEUE_LEN) {
+		event_log_tail++;
+		if (event_log_held > 0) {
+			event_log_held--;
+		} else {
+			event_log_lost++;
+		}
+	}
+	
+	// Record the event.
+	evt = &event_queue[event_head & EVENT_QUEUE_MASK];
+	evt->type = type;
+	evt->count = event_count++;
+	evt->timestamp = timestamp;
+	event_head++;
+	
+	return true;
+}
+
+/**
+ * Gets the oldest event in the queue without removing it.
+ * 
+ * @param  evt Event structure to be populated.
+ * @return     FALSE if the queue is empty.
+ */
+bool Event_Peek(event_t *evt) {
+	volatile event_t *qevt;
+	
+	// Check if we have anything in the queue.
+	if (event_head == event_tail)
+		return false;
+	
+	// Copy the event over.
+	qevt = &event_queue[event_tail & EVENT_QUEUE_MASK];
+	evt->type = qevt->type;
+	evt->count = qevt->count;
+	evt->timestamp = qevt->timestamp;
+	
+	return true;
+}
+
+/**
+ * Checks if there are any events waiting in the queue.
+ * 
+ * @return TRUE if the queue isn't empty.
+ */
+bool Event_IsPending(void) {
+	return event_head != event_tail;
+}
+
+/**
+ * Removes the oldest event from the queue.
+ */
+void Event_Pop(void) {
+	if (event_head != event_tail)
+		event_tail++;
+}
+
+/**
+ * Gets the number of events that were dropped because the queue was full.
+ * 
+ * @return Number of dropped events.
+ */
+uint16_t Event_GetDroppedCount(void) {
+	uint16_t count;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		count = event_dropped;
+	}
+	
+	return count;
+}
+
+/**
+ * Gets an event from the log without removing it.
+ * 
+ * @param  index Position of the event counting from the oldest one.
+ * @param  evt   Event structure to be populated.
+ * @return       FALSE if the log doesn't have that many events.
+ */
+bool Event_LogPeek(uint8_t index, event_t *evt) {
+	volatile event_t *qevt;
+	bool found = false;
+	
+	// The log cursor is also moved by the interrupts.
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if ((uint8_t)(event_head - event_log_tail) > index) {
+			qevt = &event_queue[(event_log_tail + index) & EVENT_QUEUE_MASK];
+			evt->type = qevt->type;
+			evt->count = qevt->count;
+			evt->timestamp = qevt->timestamp;
+			found = true;
+		}
+	}
+	
+	return found;
+}
+
+/**
+ * Holds on to the oldest events of the log that were sent to the master until
+ * it acknowledges them.
+ * 
+ * @param count Number of events that were sent.
+ */
+void Event_LogHold(uint8_t count) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		event_log_held = count;
+	}
+}
+
+/**
+ * Removes the events that were held on to from the log now that the master
+ * has got them.
+ */
+void Event_LogAck(void) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		event_log_tail += event_log_held;
+		event_log_held = 0;
+	}
+}
+
+/**
+ * Gets the number of events that were overwritten before they were read from
+ * the log.
+ * 
+ * @return Number of lost events.
+ */
+uint16_t Event_GetLogLostCount(void) {
+	uint16_t count;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		count = event_log_lost;
+	}
+	
+	return count;
+}
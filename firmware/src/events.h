@@ -0,0 +1,52 @@
+/**
+ * events.h
+ * Queue of things that happened and still need to be taken care of.
+ * 
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef EVENTS_H
+#define	EVENTS_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <inttypes.h>
+#include <stdbool.h>
+	
+// Some definitions.
+#define EVENT_QUEUE_LEN     16  // Must be a power of 2.
+#define EVENT_LOG_DRAIN_MAX 4   // Events per log drain reply.
+
+// Event types.
+typedef enum {
+	EVENT_PRESS,
+	EVENT_RELEASE
+} event_type_t;
+
+// Event structure.
+typedef struct {
+	uint8_t type;
+	uint8_t count;
+	uint16_t timestamp;
+} event_t;
+
+// Queue
+bool Event_Push(uint8_t type, uint16_t timestamp);
+bool Event_Peek(event_t *evt);
+bool Event_IsPending(void);
+void Event_Pop(void);
+uint16_t Event_GetDroppedCount(void);
+
+// Log
+bool Event_LogPeek(uint8_t index, event_t *evt);
+void Event_LogHold(uint8_t count);
+void Event_LogAck(void);
+uint16_t Event_GetLogLostCount(void);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* EVENTS_H */
@@ -9,6 +9,8 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/xmega.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
 #include <util/delay.h>
 #include <stdbool.h>
 #include <string.h>
@@ -19,20 +21,64 @@
 #include "buscomm.h"
 #include "pwm.h"
 #include "strutils.h"
-
-// Private macros.
-#define IF_COMMAND(cmdstr)    if (strcmp(frame->command, (cmdstr)) == 0)
-#define ELSIF_COMMAND(cmdstr) else IF_COMMAND(cmdstr)
+#include "events.h"
+#include "button.h"
+#include "effects.h"
+#include "enumerate.h"
+#include "commands.h"
+#include "profile.h"
 
 // Private variables.
-volatile rgb_t idle_color;
-volatile rgb_t act_color;
 volatile bool armed;
-volatile bool announce_press;
+uint32_t asleep_rtc_cnt;
 
 // Private methods.
 void Clock_Initialize(void);
 void GPIO_Initialize(void);
+void Button_HandleEvents(void);
+void Power_Sleep(void);
+const command_t* Command_Find(const char *name);
+const command_t* Command_FindOpcode(uint8_t opcode);
+void Cmd_ReplyError(const comms_frame_t *frame, const char *err);
+void Cmd_ReplyClockCal(void);
+void Cmd_ReplyColor(const char *name, rgb_t color);
+void Cmd_ParseColor(const comms_frame_t *frame, rgb_t *color);
+uint8_t Cmd_ParseHex(const comms_frame_t *frame, uint8_t index, uint8_t *buf,
+	uint8_t len);
+
+// Command handlers.
+#define COMMAND(id, name, opcode, handler, min_args, flags) \
+	static void handler(const comms_frame_t *frame);
+COMMANDS_TABLE
+#undef COMMAND
+
+// Command table indices.
+#define COMMAND(id, name, opcode, handler, min_args, flags) CMD_IDX_##id,
+enum {
+	COMMANDS_TABLE
+	COMMANDS_NUM
+};
+#undef COMMAND
+
+// Command table in flash.
+#define COMMAND(id, name, opcode, handler, min_args, flags) \
+	static const char cmd_name_##id[] PROGMEM = name;
+COMMANDS_TABLE
+#undef COMMAND
+#define COMMAND(id, name, opcode, handler, min_args, flags) \
+	{ cmd_name_##id, handler, min_args, flags },
+static const command_t commands[] PROGMEM = {
+	COMMANDS_TABLE
+};
+#undef COMMAND
+
+// Binary opcode to command table index map. (Offset by one, 0 is invalid)
+#define COMMAND(id, name, opcode, handler, min_args, flags) \
+	[opcode] = CMD_IDX_##id + 1,
+static const uint8_t cmd_opcode_map[] PROGMEM = {
+	COMMANDS_TABLE
+};
+#undef COMMAND
 
 /**
  * Program's main entry point.
@@ -42,215 +88,1059 @@ void GPIO_Initialize(void);
 int main(void) {
 	// Preamble.
 	armed = 0;
-    announce_press = 0;
 	
 	// Set things up.
 	Clock_Initialize();
+	PROF_INIT();
 	GPIO_Initialize();
 	RTC_Initialize(250, 500);
-	Config_Initialize();
+	if (!Config_Initialize())
+		Config_SetFadeTime(DEFAULT_FADE_TIME);
 	PWM_Initialize();
-	UART_Initialize(BUS_BAUD_RATE+300);
+	Button_Initialize();
+	Button_SetReleaseEvents(Config_GetFlag(CONFIG_FLAG_ANNC_RELEASE));
+	PWM_FadeToColor(Config_GetIdleColor(), Config_GetFadeTime());
+	if (Config_GetBaudRate() >= UART_BAUD_NUM)
+		Config_SetBaudRate(BUS_BAUD_RATE);
+	UART_Initialize(Config_GetBaudRate());
 	Comms_Initialize(Config_GetOurAddress());
 	sei();
 	
 	// Main application loop.
 	while (1) {
 		Comms_ParseFrame();
+		Button_HandleEvents();
+		Effect_Task();
+		Config_Task();
+		Power_Sleep();
 	}
 	
 	return 0;
 }
 
 /**
- * Handle a command issued to us.
+ * Checks if a command issued to us can be handled, replying with an error if it
+ * can't.
  * 
- * @param frame Received frame to handle.
+ * @param  frame Received command to check.
+ * @return       TRUE if the command can be handled.
+ */
+bool Comms_CheckCommand(const comms_frame_t *frame) {
+	const command_t *cmd;
+	uint8_t flags;
+	
+	// Look the command up and check if we are allowed to run it.
+	if (frame->binary) {
+		cmd = Command_FindOpcode(frame->opcode);
+	} else {
+		cmd = Command_Find(frame->command);
+	}
+	if (cmd != NULL) {
+		flags = pgm_read_byte(&cmd->flags);
+		if ((flags & CMD_FLAG_PROG) && !Button_IsPressed())
+			cmd = NULL;
+	}
+	
+	// Not a valid command for this module.
+	if (cmd == NULL) {
+		Cmd_ReplyError(frame, "INVCMD");
+		return false;
+	}
+	
+	// Make sure we've got all the arguments that the command requires.
+	if (frame->num_args < pgm_read_byte(&cmd->min_args)) {
+		Cmd_ReplyError(frame, "INVARGS");
+		return false;
+	}
+	
+	return true;
+}
+
+/**
+ * Handle a command issued to us that has already been checked.
+ * 
+ * @param frame Received command to handle.
  */
 void Comms_HandleCommand(const comms_frame_t *frame) {
-	uint8_t tmp = 0;
-
-	// Handle programming commands.
-	if (!(PORTC.IN & WALL_SW)) {
-		IF_COMMAND("SETADDR") {
-			// Sets our bus address.
-			atou8(&tmp, frame->args[0]);
-			Comms_SetOurAddress(tmp, true);
-			Comms_AddrReply(Config_GetOurAddress(), "ADDRSET OK");
+	const command_t *cmd;
+	
+	if (frame->binary) {
+		cmd = Command_FindOpcode(frame->opcode);
+	} else {
+		cmd = Command_Find(frame->command);
+	}
+	
+	((cmd_handler_t)pgm_read_word(&cmd->handler))(frame);
+}
+
+/**
+ * Takes care of the button events that were queued up by the interrupts.
+ */
+void Button_HandleEvents(void) {
+	static bool acted = false;
+	event_t evt;
+	char msg[10];
+	
+	// Check if we have anything to take care of.
+	if (!Event_Peek(&evt))
+		return;
+	
+	// Take care of things locally right away.
+	if (!acted) {
+		if ((evt.type == EVENT_PRESS) && armed) {
+			// Reset the button state.
+			Effect_Stop();
+			PWM_FadeToColor(Config_GetIdleColor(), Config_GetFadeTime());
+			armed = false;
+		}
 		
+		acted = true;
+	}
+	
+	// Announce the event once we get access to the bus.
+	if (evt.type == EVENT_PRESS) {
+		if (Config_GetFlag(CONFIG_FLAG_ANNC_PRESS)) {
+			strcomb(msg, "TRIGD ", Comms_GetAddrStr());
+			if (!Comms_Announce(msg))
+				return;
+		}
+	} else {
+		strcomb(msg, "RELSD ", Comms_GetAddrStr());
+		if (!Comms_Announce(msg))
 			return;
-		} ELSIF_COMMAND("SETCLKCAL") {
-            // Sets the clock calibration factor.
-            int8_t itmp = 0;
-            atoi8(&itmp, frame->args[0]);
-            Config_SetClockCalFactor(itmp);
-            UART_Initialize(BUS_BAUD_RATE);
-
-            Comms_ReplyStart();
-            UART_SendString("CLKCAL ");
-            UART_SendInt8(Config_GetClockCalFactor());
-            Comms_ReplyEnd();
-
-            return;
-        } ELSIF_COMMAND("CLKCAL+") {
-            // Increases our clock calibration factor.
-            Config_SetClockCalFactor(Config_GetClockCalFactor() + 1);
-            UART_Initialize(BUS_BAUD_RATE);
-
-            Comms_ReplyStart();
-            UART_SendString("CLKCAL ");
-            UART_SendInt8(Config_GetClockCalFactor());
-            Comms_ReplyEnd();
-
-            return;
-        } ELSIF_COMMAND("CLKCAL-") {
-            // Increases our clock calibration factor.
-            Config_SetClockCalFactor(Config_GetClockCalFactor() - 1);
-            UART_Initialize(BUS_BAUD_RATE);
-
-            Comms_ReplyStart();
-            UART_SendString("CLKCAL ");
-            UART_SendInt8(Config_GetClockCalFactor());
-            Comms_ReplyEnd();
-
-            return;
-        }
-	}
-    
-	IF_COMMAND("CLKCAL?") {
-		// Gets the clock calibration factor.
-		Comms_ReplyStart();
-		UART_SendString("CLKCAL ");
-		UART_SendInt8(Config_GetClockCalFactor());
-		Comms_ReplyEnd();
+	}
+	
+	Event_Pop();
+	acted = false;
+}
 
+/**
+ * Puts us to sleep until the next interrupt if there's nothing left to do.
+ * We'll go into standby if the LEDs are off, the bus is quiet and no EEPROM
+ * writes are pending, since the USART start-of-frame detector, the wall switch
+ * and the RTC can all wake us up from it. Otherwise we just idle the CPU.
+ */
+void Power_Sleep(void) {
+	uint16_t start;
+	uint16_t end;
+	
+	// Make sure nothing sneaks in between checking and going to sleep.
+	cli();
+	if (Comms_IsFramePending() || Event_IsPending() || Effect_IsWaiting()) {
+		sei();
 		return;
-	} ELSIF_COMMAND("WBIDLCOLOR") {
-		// Sets the idle color.
-		atou8(&tmp, frame->args[0]);
-		idle_color.r = tmp;
-		atou8(&tmp, frame->args[1]);
-		idle_color.g = tmp;
-		atou8(&tmp, frame->args[2]);
-		idle_color.b = tmp;
+	}
+	
+	// Choose how deep we can sleep.
+	if (PWM_IsOff() && !UART_IsTransmitting() && !Comms_IsReceiving() &&
+			!Config_IsWriting()) {
+		set_sleep_mode(SLEEP_MODE_STANDBY);
+	} else {
+		set_sleep_mode(SLEEP_MODE_IDLE);
+	}
+	
+	// Go to sleep. (Interrupts are only enabled after the next instruction)
+	start = RTC.CNT;
+	sleep_enable();
+	sei();
+	sleep_cpu();
+	sleep_disable();
+	end = RTC.CNT;
+	
+	// Keep track of how long we've slept for.
+	if (end < start)
+		end += RTC.PER + 1;
+	asleep_rtc_cnt += end - start;
+}
+
+/**
+ * Looks up a command in our command table.
+ * 
+ * @param  name Name of the command.
+ * @return      Command table entry in flash or NULL if it wasn't found.
+ */
+const command_t* Command_Find(const char *name) {
+	uint8_t lo = 0;
+	uint8_t hi = COMMANDS_NUM;
+	
+	// Binary search the sorted command table.
+	while (lo < hi) {
+		uint8_t mid = (lo + hi) / 2;
+		int cmp = strcmp_P(name, (const char *)pgm_read_word(&commands[mid].name));
 		
-		if (!armed)
-			PWM_SetColor(idle_color);
+		if (cmp == 0) {
+			return &commands[mid];
+		} else if (cmp < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	
+	return NULL;
+}
+
+/**
+ * Looks up a binary frame opcode in our command table.
+ * 
+ * @param  opcode Opcode of the command.
+ * @return        Command table entry in flash or NULL if it wasn't found.
+ */
+const command_t* Command_FindOpcode(uint8_t opcode) {
+	uint8_t idx;
+	
+	if (opcode >= sizeof(cmd_opcode_map))
+		return NULL;
+	
+	idx = pgm_read_byte(&cmd_opcode_map[opcode]);
+	return (idx > 0) ? &commands[idx - 1] : NULL;
+}
+
+/**
+ * Replies with an error message about a command if it was addressed to us.
+ * 
+ * @param frame Frame that caused the error.
+ * @param err   Error message.
+ */
+void Cmd_ReplyError(const comms_frame_t *frame, const char *err) {
+	if (!Comms_IsUnicast(frame))
+		return;
+	
+	Comms_ReplyStart();
+	UART_SendString(err);
+	if (frame->binary) {
+		UART_SendString(" #");
+		UART_SendUInt8(frame->opcode);
+	} else {
+		UART_SendString(" \"");
+		UART_SendString(frame->command);
+		UART_SendChar('"');
+	}
+	Comms_ReplyEnd();
+}
+
+/**
+ * Replies with our current clock calibration factor.
+ */
+void Cmd_ReplyClockCal(void) {
+	Comms_ReplyStart();
+	UART_SendString("CLKCAL ");
+	UART_SendInt8(Config_GetClockCalFactor());
+	Comms_ReplyEnd();
+}
+
+/**
+ * Replies with a color.
+ * 
+ * @param name  Name of the color setting.
+ * @param color Color to be sent.
+ */
+void Cmd_ReplyColor(const char *name, rgb_t color) {
+	Comms_ReplyStart();
+	UART_SendString(name);
+	UART_SendChar(' ');
+	UART_SendUInt8(color.r);
+	UART_SendChar(' ');
+	UART_SendUInt8(color.g);
+	UART_SendChar(' ');
+	UART_SendUInt8(color.b);
+	Comms_ReplyEnd();
+}
+
+/**
+ * Parses a color from the arguments of a frame.
+ * 
+ * @param frame Frame with the red, green and blue components as arguments.
+ * @param color Color to be populated.
+ */
+void Cmd_ParseColor(const comms_frame_t *frame, rgb_t *color) {
+	color->r = Comms_GetArgU8(frame, 0);
+	color->g = Comms_GetArgU8(frame, 1);
+	color->b = Comms_GetArgU8(frame, 2);
+}
+
+/**
+ * Parses a hexadecimal string argument of a frame into raw bytes. Binary
+ * frames carry them as raw bytes from the index-th byte of the payload up to
+ * its end instead.
+ * 
+ * @param  frame Frame to get the argument from.
+ * @param  index Index of the argument.
+ * @param  buf   Buffer to store the bytes in. (Zero padded)
+ * @param  len   Size of the buffer.
+ * @return       Number of bytes parsed or 0 if the argument isn't valid.
+ */
+uint8_t Cmd_ParseHex(const comms_frame_t *frame, uint8_t index, uint8_t *buf,
+		uint8_t len) {
+	const char *str;
+	uint8_t n = 0;
+	int8_t hi;
+	int8_t lo;
+	
+	memset(buf, 0, len);
+	if (index >= frame->num_args)
+		return 0;
+	
+	// Binary frames carry their arguments as raw bytes.
+	if (frame->binary) {
+		n = frame->num_args - index;
+		if (n > len)
+			n = len;
+		memcpy(buf, frame->args[0] + index, n);
 		
-		if (frame->addr > 0)
-			Comms_Reply("OK");
+		return n;
+	}
+	
+	// Go through the digits in pairs.
+	str = frame->args[index];
+	while (*str != '\0') {
+		hi = hexdigit(*str++);
+		lo = (*str != '\0') ? hexdigit(*str++) : 0;
+		if ((n >= len) || (hi < 0) || (lo < 0))
+			return 0;
 		
+		buf[n++] = (uint8_t)((hi << 4) | lo);
+	}
+	
+	return n;
+}
+
+/**
+ * SETADDR: Sets our bus address.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_SetAddress(const comms_frame_t *frame) {
+	uint8_t addr = Comms_GetArgU8(frame, 0);
+	
+	// Broadcast and group addresses can't be assigned to a node.
+	if ((addr == 0) || (addr >= COMMS_GROUP_ADDR_BASE)) {
+		Cmd_ReplyError(frame, "INVARGS");
 		return;
-	} ELSIF_COMMAND("WBIDLCOLOR?") {
-		// Gets the idle color.
-		Comms_ReplyStart();
-		UART_SendString("WBIDLCOLOR ");
-		UART_SendUInt8(idle_color.r);
-		UART_SendChar(' ');
-		UART_SendUInt8(idle_color.g);
-		UART_SendChar(' ');
-		UART_SendUInt8(idle_color.b);
-		Comms_ReplyEnd();
-		
+	}
+	
+	Comms_SetOurAddress(addr, true);
+	Comms_AddrReply(Config_GetOurAddress(), "ADDRSET OK");
+}
+
+/**
+ * ENUMRST: Starts a new enumeration session. Nodes that already have an
+ * assigned address only take part in it if the optional argument is 1.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_ResetEnumeration(const comms_frame_t *frame) {
+	Enum_Reset((frame->num_args > 0) && Comms_GetArgU8(frame, 0));
+	
+	if (Comms_IsUnicast(frame))
+		Comms_Reply("OK");
+}
+
+/**
+ * ENUM: Replies with our slot and serial number in that slot if it starts
+ * with the given number of bits of the (hexadecimal) prefix.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_Enumerate(const comms_frame_t *frame) {
+	uint8_t prefix[ENUM_SERIAL_LEN];
+	char serial[(ENUM_SERIAL_LEN * 2) + 1];
+	int8_t slot;
+	
+	// An empty prefix is perfectly fine.
+	if ((Cmd_ParseHex(frame, 1, prefix, sizeof(prefix)) == 0) &&
+			(frame->num_args > 1) && !frame->binary) {
+		Cmd_ReplyError(frame, "INVARGS");
 		return;
-	} ELSIF_COMMAND("WBACTCOLOR") {
-		// Sets the actuated color.
-		atou8(&tmp, frame->args[0]);
-		act_color.r = tmp;
-		atou8(&tmp, frame->args[1]);
-		act_color.g = tmp;
-		atou8(&tmp, frame->args[2]);
-		act_color.b = tmp;
-
-		if (frame->addr > 0)
-			Comms_Reply("OK");
-		
+	}
+	
+	// Check if we should answer.
+	slot = Enum_Match(Comms_GetArgU8(frame, 0), prefix);
+	if (slot < 0)
 		return;
-	} ELSIF_COMMAND("WBACTCOLOR?") {
-		// Gets the actuated color.
-		Comms_ReplyStart();
-		UART_SendString("WBACTCOLOR ");
-		UART_SendUInt8(act_color.r);
-		UART_SendChar(' ');
-		UART_SendUInt8(act_color.g);
-		UART_SendChar(' ');
-		UART_SendUInt8(act_color.b);
-		Comms_ReplyEnd();
-		
+	
+	// Reply in our slot.
+	Enum_GetSerialStr(serial);
+	Comms_HoldReply((uint8_t)slot);
+	Comms_ReplyStart();
+	UART_SendString("ENUM ");
+	UART_SendUInt8((uint8_t)slot);
+	UART_SendChar(' ');
+	UART_SendString(serial);
+	Comms_ReplyEnd();
+}
+
+/**
+ * ASSIGN: Sets our bus address if the serial number is ours, taking us out of
+ * the enumeration session.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_AssignAddress(const comms_frame_t *frame) {
+	uint8_t serial[ENUM_SERIAL_LEN];
+	uint8_t addr = Comms_GetArgU8(frame, 0);
+	
+	// Is it for us?
+	if ((Cmd_ParseHex(frame, 1, serial, sizeof(serial)) != ENUM_SERIAL_LEN) ||
+			!Enum_IsOurSerial(serial)) {
+		return;
+	}
+	
+	// Broadcast and group addresses can't be assigned to a node.
+	if ((addr == 0) || (addr >= COMMS_GROUP_ADDR_BASE)) {
+		Cmd_ReplyError(frame, "INVARGS");
 		return;
-	} ELSIF_COMMAND("WBARM") {
-		// Arms the bomb.
-		PWM_SetColor(act_color);
-		armed = true;
+	}
+	
+	// Only one node can match, so it's safe to reply to a broadcast.
+	Enum_Leave();
+	Comms_SetOurAddress(addr, true);
+	Comms_AddrReply(addr, "ADDRSET OK");
+}
 
-		if (frame->addr > 0)
-			Comms_Reply("OK");
-		
+/**
+ * SETCLKCAL: Sets the clock calibration factor.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_SetClockCal(const comms_frame_t *frame) {
+	Config_SetClockCalFactor(Comms_GetArgI8(frame, 0));
+	UART_Initialize(UART_GetBaudRate());
+	Cmd_ReplyClockCal();
+}
+
+/**
+ * CLKCAL+: Increases our clock calibration factor.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_IncreaseClockCal(const comms_frame_t *frame) {
+	Config_SetClockCalFactor(Config_GetClockCalFactor() + 1);
+	UART_Initialize(UART_GetBaudRate());
+	Cmd_ReplyClockCal();
+}
+
+/**
+ * CLKCAL-: Decreases our clock calibration factor.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_DecreaseClockCal(const comms_frame_t *frame) {
+	Config_SetClockCalFactor(Config_GetClockCalFactor() - 1);
+	UART_Initialize(UART_GetBaudRate());
+	Cmd_ReplyClockCal();
+}
+
+/**
+ * CLKCAL?: Gets the clock calibration factor.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_GetClockCal(const comms_frame_t *frame) {
+	Cmd_ReplyClockCal();
+}
+
+/**
+ * SETBAUD: Sets the baud rate that we'll switch to on a BAUDCOMMIT.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_SetBaudRate(const comms_frame_t *frame) {
+	if (!Comms_SetPendingBaudRate(Comms_GetArgU8(frame, 0))) {
+		Cmd_ReplyError(frame, "INVARGS");
 		return;
-	} ELSIF_COMMAND("WBARM?") {
-		// Checks if the button is armed.
-		Comms_ReplyStart();
-		UART_SendString("WBARM ");
-		UART_SendChar((armed) ? '1' : '0');
-		Comms_ReplyEnd();
-		
+	}
+	
+	if (Comms_IsUnicast(frame))
+		Comms_Reply("OK");
+}
+
+/**
+ * BAUDCOMMIT: Switches over to the baud rate set by SETBAUD.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_CommitBaudRate(const comms_frame_t *frame) {
+	if (Comms_GetPendingBaudRate() == BAUD_NONE) {
+		Cmd_ReplyError(frame, "GENERR");
 		return;
-	} ELSIF_COMMAND("ANNCPRESS") {
-		// Sets the announce pressed flag.
-		atou8(&tmp, frame->args[0]);
-		announce_press = tmp;
-		
-		if (frame->addr > 0)
-			Comms_Reply("OK");
-		
+	}
+	
+	// The switch only happens after the whole frame has been replied to.
+	if (Comms_IsUnicast(frame))
+		Comms_Reply("OK");
+	Comms_CommitBaudRate();
+}
+
+/**
+ * BAUD?: Gets the current and pending baud rates.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_GetBaudRate(const comms_frame_t *frame) {
+	uint8_t pending = Comms_GetPendingBaudRate();
+	
+	Comms_ReplyStart();
+	UART_SendString("BAUD ");
+	UART_SendUInt8(UART_GetBaudRate());
+	UART_SendChar(' ');
+	UART_SendUInt8((pending == BAUD_NONE) ? UART_GetBaudRate() : pending);
+	Comms_ReplyEnd();
+}
+
+/**
+ * WBIDLCOLOR: Sets the idle color.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_SetIdleColor(const comms_frame_t *frame) {
+	rgb_t color;
+	
+	Cmd_ParseColor(frame, &color);
+	Config_SetIdleColor(color);
+	if (!armed && !Effect_IsRunning())
+		PWM_FadeToColor(color, Config_GetFadeTime());
+	
+	if (Comms_IsUnicast(frame))
+		Comms_Reply("OK");
+}
+
+/**
+ * WBIDLCOLOR?: Gets the idle color.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_GetIdleColor(const comms_frame_t *frame) {
+	Cmd_ReplyColor("WBIDLCOLOR", Config_GetIdleColor());
+}
+
+/**
+ * WBACTCOLOR: Sets the actuated color.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_SetActuatedColor(const comms_frame_t *frame) {
+	rgb_t color;
+	
+	Cmd_ParseColor(frame, &color);
+	Config_SetActuatedColor(color);
+	
+	if (Comms_IsUnicast(frame))
+		Comms_Reply("OK");
+}
+
+/**
+ * WBACTCOLOR?: Gets the actuated color.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_GetActuatedColor(const comms_frame_t *frame) {
+	Cmd_ReplyColor("WBACTCOLOR", Config_GetActuatedColor());
+}
+
+/**
+ * WBARM: Arms the bomb.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_Arm(const comms_frame_t *frame) {
+	Effect_Stop();
+	PWM_FadeToColor(Config_GetActuatedColor(), Config_GetFadeTime());
+	armed = true;
+
+	if (Comms_IsUnicast(frame))
+		Comms_Reply("OK");
+}
+
+/**
+ * WBFADE: Fades to an arbitrary color over a given time in 10ms units.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_Fade(const comms_frame_t *frame) {
+	rgb_t color;
+	
+	color.r = Comms_GetArgU8(frame, 0);
+	color.g = Comms_GetArgU8(frame, 1);
+	color.b = Comms_GetArgU8(frame, 2);
+	Effect_Stop();
+	PWM_FadeToColor(color, Comms_GetArgU8(frame, 3) * 10);
+	
+	if (Comms_IsUnicast(frame))
+		Comms_Reply("OK");
+}
+
+/**
+ * WBFADETIME: Sets the time it takes to transition between the idle and
+ * actuated colors in 10ms units.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_SetFadeTime(const comms_frame_t *frame) {
+	Config_SetFadeTime(Comms_GetArgU8(frame, 0) * 10);
+	
+	if (Comms_IsUnicast(frame))
+		Comms_Reply("OK");
+}
+
+/**
+ * WBFADETIME?: Gets the time it takes to transition between colors.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_GetFadeTime(const comms_frame_t *frame) {
+	Comms_ReplyStart();
+	UART_SendString("WBFADETIME ");
+	UART_SendUInt8(Config_GetFadeTime() / 10);
+	Comms_ReplyEnd();
+}
+
+/**
+ * WBARM?: Checks if the button is armed.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_GetArmed(const comms_frame_t *frame) {
+	Comms_ReplyStart();
+	UART_SendString("WBARM ");
+	UART_SendChar((armed) ? '1' : '0');
+	Comms_ReplyEnd();
+}
+
+/**
+ * ANNCPRESS: Sets the announce pressed flag.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_SetAnnouncePress(const comms_frame_t *frame) {
+	Config_SetFlag(CONFIG_FLAG_ANNC_PRESS, Comms_GetArgU8(frame, 0));
+	
+	if (Comms_IsUnicast(frame))
+		Comms_Reply("OK");
+}
+
+/**
+ * ANNCPRESS?: Gets the announce pressed flag.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_GetAnnouncePress(const comms_frame_t *frame) {
+	Comms_ReplyStart();
+	UART_SendString("ANNCPRESS ");
+	UART_SendChar((Config_GetFlag(CONFIG_FLAG_ANNC_PRESS)) ? '1' : '0');
+	Comms_ReplyEnd();
+}
+
+/**
+ * ANNCRELEASE: Sets whether button releases are also announced.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_SetAnnounceRelease(const comms_frame_t *frame) {
+	Button_SetReleaseEvents(Comms_GetArgU8(frame, 0));
+	Config_SetFlag(CONFIG_FLAG_ANNC_RELEASE, Button_GetReleaseEvents());
+	
+	if (Comms_IsUnicast(frame))
+		Comms_Reply("OK");
+}
+
+/**
+ * ANNCRELEASE?: Gets whether button releases are also announced.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_GetAnnounceRelease(const comms_frame_t *frame) {
+	Comms_ReplyStart();
+	UART_SendString("ANNCRELEASE ");
+	UART_SendChar((Button_GetReleaseEvents()) ? '1' : '0');
+	Comms_ReplyEnd();
+}
+
+/**
+ * BOOT: Saves our configuration and resets into the bootloader to receive a
+ * firmware update. Must be sent with BOOT_MAGIC_HI and BOOT_MAGIC_LO as its
+ * arguments.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_EnterBootloader(const comms_frame_t *frame) {
+	// Resetting by accident would take us off the bus.
+	if ((Comms_GetArgU8(frame, 0) != BOOT_MAGIC_HI) ||
+			(Comms_GetArgU8(frame, 1) != BOOT_MAGIC_LO)) {
+		Cmd_ReplyError(frame, "INVARGS");
 		return;
-	} ELSIF_COMMAND("ANNCPRESS?") {
-		// Gets the announce pressed flag.
-		Comms_ReplyStart();
-		UART_SendString("ANNCPRESS ");
-		UART_SendUInt8(announce_press);
-		Comms_ReplyEnd();
-		
+	}
+	
+	// Make sure the configuration survives the trip.
+	Config_Commit();
+	while (Config_IsWriting())
+		;
+	
+	if (Comms_IsUnicast(frame))
+		Comms_Reply("OK");
+	UART_Flush();
+	
+	// The bootloader stays in charge after a software reset.
+	cli();
+	_PROTECTED_WRITE(RSTCTRL.SWRR, RSTCTRL_SWRE_bm);
+}
+
+/**
+ * SLEEP?: Gets how many seconds we've spent asleep since we've started.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_GetSleepTime(const comms_frame_t *frame) {
+	Comms_ReplyStart();
+	UART_SendString("SLEEP ");
+	UART_SendUInt16((uint16_t)(asleep_rtc_cnt / 32768));
+	UART_SendChar(' ');
+	UART_SendUInt16(RTC_GetSeconds());
+	Comms_ReplyEnd();
+}
+
+/**
+ * EVLOG: Drains up to the requested number of events from the event log,
+ * replying with the current RTC tick, how many events were lost and each
+ * event as its type, count and timestamp. Events are only removed once the
+ * next EVLOG with a new sequence number acknowledges them, so a retransmission
+ * gets the same events again.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_DrainEventLog(const comms_frame_t *frame) {
+	event_t evt;
+	uint8_t num = 1;
+	uint8_t i;
+	
+	// A new request means that the master got the last batch.
+	if (!frame->repeat)
+		Event_LogAck();
+	
+	// Get how many events the master wants.
+	if (frame->num_args > 0)
+		num = Comms_GetArgU8(frame, 0);
+	if (num > EVENT_LOG_DRAIN_MAX)
+		num = EVENT_LOG_DRAIN_MAX;
+	
+	Comms_ReplyStart();
+	UART_SendString("EVLOG ");
+	UART_SendUInt16(RTC_GetTicks());
+	UART_SendChar(' ');
+	UART_SendUInt16(Event_GetLogLostCount());
+	for (i = 0; (i < num) && Event_LogPeek(i, &evt); i++) {
+		UART_SendChar(' ');
+		UART_SendChar((evt.type == EVENT_PRESS) ? 'P' : 'R');
+		UART_SendUInt8(evt.count);
+		UART_SendChar('@');
+		UART_SendUInt16(evt.timestamp);
+	}
+	Comms_ReplyEnd();
+	
+	// Without a sequence number the master can't ask for this batch again.
+	Event_LogHold(i);
+	if (!frame->has_seq)
+		Event_LogAck();
+}
+
+/**
+ * FXKEY: Sets a keyframe of the effect program as index, color, time in 10ms
+ * units and an optional easing curve.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_SetEffectKeyframe(const comms_frame_t *frame) {
+	fx_keyframe_t kf;
+	uint8_t index;
+	
+	// Parse the keyframe.
+	index = Comms_GetArgU8(frame, 0);
+	kf.color.r = Comms_GetArgU8(frame, 1);
+	kf.color.g = Comms_GetArgU8(frame, 2);
+	kf.color.b = Comms_GetArgU8(frame, 3);
+	kf.time = Comms_GetArgU8(frame, 4);
+	kf.easing = (frame->num_args > 5) ? Comms_GetArgU8(frame, 5) :
+		PWM_EASE_LINEAR;
+	
+	// Check if it makes sense.
+	if ((index >= FX_KEYFRAMES_MAX) || (kf.easing >= PWM_EASE_NUM)) {
+		Cmd_ReplyError(frame, "INVARGS");
 		return;
-	} ELSIF_COMMAND("PRESSED?") {
-		// Checks if the button is pressed.
-		Comms_ReplyStart();
-		UART_SendString("PRESSED ");
-		UART_SendChar((!(PORTC.IN & WALL_SW)) ? '1' : '0');
-		Comms_ReplyEnd();
-		
+	}
+	
+	Config_SetEffectKeyframe(index, &kf);
+	
+	if (Comms_IsUnicast(frame))
+		Comms_Reply("OK");
+}
+
+/**
+ * FXKEY?: Gets a keyframe of the effect program.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_GetEffectKeyframe(const comms_frame_t *frame) {
+	fx_keyframe_t kf;
+	uint8_t index;
+	
+	// Check if the keyframe exists.
+	index = Comms_GetArgU8(frame, 0);
+	if (index >= FX_KEYFRAMES_MAX) {
+		Cmd_ReplyError(frame, "INVARGS");
 		return;
-	} ELSIF_COMMAND("WHAT?") {
-		// What are we?
-		Comms_AddrReply(Config_GetOurAddress(), "WALLBUTTON");
+	}
+	
+	Config_GetEffectKeyframe(index, &kf);
+	Comms_ReplyStart();
+	UART_SendString("FXKEY ");
+	UART_SendUInt8(index);
+	UART_SendChar(' ');
+	UART_SendUInt8(kf.color.r);
+	UART_SendChar(' ');
+	UART_SendUInt8(kf.color.g);
+	UART_SendChar(' ');
+	UART_SendUInt8(kf.color.b);
+	UART_SendChar(' ');
+	UART_SendUInt8(kf.time);
+	UART_SendChar(' ');
+	UART_SendUInt8(kf.easing);
+	Comms_ReplyEnd();
+}
+
+/**
+ * FXLEN: Sets the number of keyframes in the effect program and optionally how
+ * many times it should be played. (0 for forever)
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_SetEffectLength(const comms_frame_t *frame) {
+	uint8_t len = Comms_GetArgU8(frame, 0);
+	
+	if (len > FX_KEYFRAMES_MAX) {
+		Cmd_ReplyError(frame, "INVARGS");
 		return;
-	} else {
-		// Not a valid command for this module.
-		if (frame->addr > 0) {
-			Comms_ReplyStart();
-			UART_SendString("INVCMD \"");
-			UART_SendString(frame->command);
-			UART_SendChar('"');
-			Comms_ReplyEnd();
-		}
-		
+	}
+	
+	Config_SetEffectLength(len, (frame->num_args > 1) ?
+		Comms_GetArgU8(frame, 1) : 0);
+	
+	if (Comms_IsUnicast(frame))
+		Comms_Reply("OK");
+}
+
+/**
+ * FXLEN?: Gets the number of keyframes in the effect program and how many
+ * times it should be played.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_GetEffectLength(const comms_frame_t *frame) {
+	Comms_ReplyStart();
+	UART_SendString("FXLEN ");
+	UART_SendUInt8(Config_GetEffectLength());
+	UART_SendChar(' ');
+	UART_SendUInt8(Config_GetEffectLoops());
+	Comms_ReplyEnd();
+}
+
+/**
+ * FXPLAY: Starts playing the effect program.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_PlayEffect(const comms_frame_t *frame) {
+	if (!Effect_Start()) {
+		Cmd_ReplyError(frame, "GENERR");
 		return;
 	}
 	
-	// Ooops.
-	if (frame->addr > 0) {
-		Comms_ReplyStart();
-		UART_SendString("GENERR \"");
-		UART_SendString(frame->command);
-		UART_SendChar('"');
-		Comms_ReplyEnd();
+	if (Comms_IsUnicast(frame))
+		Comms_Reply("OK");
+}
+
+/**
+ * FXPLAY?: Checks if the effect program is playing.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_GetEffectPlaying(const comms_frame_t *frame) {
+	Comms_ReplyStart();
+	UART_SendString("FXPLAY ");
+	UART_SendChar((Effect_IsRunning()) ? '1' : '0');
+	Comms_ReplyEnd();
+}
+
+/**
+ * FXSTOP: Stops the effect program and goes back to the button's color.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_StopEffect(const comms_frame_t *frame) {
+	Effect_Stop();
+	PWM_FadeToColor((armed) ? Config_GetActuatedColor() : Config_GetIdleColor(),
+		Config_GetFadeTime());
+	
+	if (Comms_IsUnicast(frame))
+		Comms_Reply("OK");
+}
+
+/**
+ * GROUPADD: Makes us a member of a group.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_AddGroup(const comms_frame_t *frame) {
+	uint8_t group = Comms_GetArgU8(frame, 0);
+	
+	if (group >= COMMS_GROUPS_NUM) {
+		Cmd_ReplyError(frame, "INVARGS");
+		return;
+	}
+	
+	Config_SetGroups(Config_GetGroups() | (1U << group));
+	
+	if (Comms_IsUnicast(frame))
+		Comms_Reply("OK");
+}
+
+/**
+ * GROUPDEL: Removes us from a group.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_RemoveGroup(const comms_frame_t *frame) {
+	uint8_t group = Comms_GetArgU8(frame, 0);
+	
+	if (group >= COMMS_GROUPS_NUM) {
+		Cmd_ReplyError(frame, "INVARGS");
+		return;
 	}
+	
+	Config_SetGroups(Config_GetGroups() & ~(1U << group));
+	
+	if (Comms_IsUnicast(frame))
+		Comms_Reply("OK");
+}
+
+/**
+ * GROUPS?: Gets the bitmask of groups that we are a member of.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_GetGroups(const comms_frame_t *frame) {
+	Comms_ReplyStart();
+	UART_SendString("GROUPS ");
+	UART_SendUInt16(Config_GetGroups());
+	Comms_ReplyEnd();
+}
+
+/**
+ * STATS?: Gets the bus statistics in the order of the comms_stats_t structure
+ * followed by the number of bytes sent and button events dropped.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_GetStats(const comms_frame_t *frame) {
+	comms_stats_t stats;
+	const uint16_t *counter = (const uint16_t *)&stats;
+	
+	Comms_GetStats(&stats);
+	Comms_ReplyStart();
+	UART_SendString("STATS");
+	for (uint8_t i = 0; i < (sizeof(stats) / sizeof(uint16_t)); i++) {
+		UART_SendChar(' ');
+		UART_SendUInt16(counter[i]);
+	}
+	UART_SendChar(' ');
+	UART_SendUInt16(UART_GetSentByteCount());
+	UART_SendChar(' ');
+	UART_SendUInt16(Event_GetDroppedCount());
+	Comms_ReplyEnd();
+}
+
+/**
+ * STATSRST: Resets the bus statistics.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_ResetStats(const comms_frame_t *frame) {
+	Comms_ResetStats();
+	UART_ResetSentByteCount();
+	
+	if (Comms_IsUnicast(frame))
+		Comms_Reply("OK");
+}
+
+#ifdef PROF_ENABLED
+/**
+ * PROF?: Gets the minimum, maximum and last run times of a profiled section in
+ * timer ticks. (2 CPU cycles each)
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_GetProfile(const comms_frame_t *frame) {
+	prof_stats_t stats;
+	uint8_t section = Comms_GetArgU8(frame, 0);
+	
+	if (section >= PROF_SECTIONS_NUM) {
+		Cmd_ReplyError(frame, "INVARGS");
+		return;
+	}
+	
+	Prof_GetStats(section, &stats);
+	Comms_ReplyStart();
+	UART_SendString("PROF ");
+	UART_SendUInt8(section);
+	UART_SendChar(' ');
+	UART_SendUInt16(stats.min);
+	UART_SendChar(' ');
+	UART_SendUInt16(stats.max);
+	UART_SendChar(' ');
+	UART_SendUInt16(stats.last);
+	Comms_ReplyEnd();
+}
+
+/**
+ * PROFRST: Resets the profiling statistics.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_ResetProfile(const comms_frame_t *frame) {
+	Prof_Reset();
+	
+	if (Comms_IsUnicast(frame))
+		Comms_Reply("OK");
+}
+#endif  /* PROF_ENABLED */
+
+/**
+ * PRESSED?: Checks if the button is pressed.
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_GetPressed(const comms_frame_t *frame) {
+	Comms_ReplyStart();
+	UART_SendString("PRESSED ");
+	UART_SendChar((Button_IsPressed()) ? '1' : '0');
+	Comms_ReplyEnd();
+}
+
+/**
+ * WHAT?: What are we?
+ * 
+ * @param frame Received frame.
+ */
+static void Cmd_What(const comms_frame_t *frame) {
+	Comms_AddrReply(Config_GetOurAddress(), "WALLBUTTON");
 }
 
 /**
  * Interrupt service routine that's called when an RTC PIT period has completed.
  */
 ISR(RTC_PIT_vect) {
+	RTC_Tick();
+	Button_Tick();
+	
 	// Clear the interrupt flag.
 	RTC.PITINTFLAGS = RTC_PI_bm;
 }
@@ -264,60 +1154,88 @@ ISR(RTC_CNT_vect) {
     if (RTC.INTFLAGS & RTC_CMP_bm)
 		PORTC.OUTTGL = STATUS_LED;
 	
+	// Keep track of time.
+	if (RTC.INTFLAGS & RTC_OVF_bm)
+		Comms_Tick();
+	
 	// Clear the interrupt flag.
     RTC.INTFLAGS = (RTC_OVF_bm | RTC_CMP_bm);
 }
 
+/**
+ * Interrupt service routine that's called when the UART is ready to accept
+ * more data to be transmitted.
+ */
+ISR(USART0_DRE_vect) {
+	UART_HandleDataRegisterEmpty();
+}
+
 /**
  * Interrupt service routine that's called when an UART transmission has ended.
  */
 ISR(USART0_TXC_vect) {
-	if (USART0.STATUS & USART_DREIF_bm)
-		PORTB.OUTCLR = TX_EN;         // Put the RS-485 transceiver in RX mode.
-
-	USART0.STATUS |= USART_TXCIF_bm;  // Clear the interrupt flag.
+	UART_HandleTransmitComplete();
 }
 
 /**
  * Interrupt service routine that's called when we receive something via UART.
  */
 ISR(USART0_RXC_vect) {
-	while (USART0.RXDATAH & USART_RXCIF_bm) {
+	uint8_t flags;
+	PROF_START(prof);
+	
+	// A sync field that didn't make sense leaves the baud rate alone.
+	if (USART0.STATUS & USART_ISFIF_bm) {
+		USART0.STATUS = USART_ISFIF_bm;
+		Comms_ReceiveError(USART_FERR_bm);
+	}
+	
+	while ((flags = USART0.RXDATAH) & USART_RXCIF_bm) {
 		// Check for errors.
-		if (USART0.RXDATAH & (USART_BUFOVF_bm | USART_FERR_bm | USART_PERR_bm)) {
+		if (flags & (USART_BUFOVF_bm | USART_FERR_bm | USART_PERR_bm)) {
 			// Read the registers to clear the BUFOVF flag.
 			USART0.RXDATAH;
 			USART0.RXDATAL;
 			
 			// Discard the frame.
-			Comms_ResetRXBuffer();
+			Comms_ReceiveError(flags);
 			continue;
 		}
 
 		// Handle the received character.
 		Comms_ReceiveChar((char)USART0.RXDATAL);
 	}
+	
+	PROF_END(PROF_RX_ISR, prof);
 }
 
 /**
- * Interrupt service routine that's called when a pin in PORTC changes.
+ * Interrupt service routine that's called when the PWM timer underflows.
  */
-ISR(PORTC_PORT_vect) {
-    // Announce that the button was pressed.
-    if (announce_press) {
-        char reply[12];
+ISR(TCA0_LUNF_vect) {
+	PWM_HandleFadeTick();
+	
+	// Clear the interrupt flag.
+	TCA0.SPLIT.INTFLAGS = TCA_SPLIT_LUNF_bm;
+}
 
-        // Send back our reply.
-        strcomb(reply, "TRIGD ", Comms_GetAddrStr());
-        Comms_AddrReply(0, reply);
-    }
+/**
+ * Interrupt service routine that's called when the EEPROM is ready to be
+ * written to.
+ */
+ISR(NVMCTRL_EE_vect) {
+	Config_HandleWriteReady();
+	
+	// Clear the interrupt flag.
+	NVMCTRL.INTFLAGS = NVMCTRL_EEREADY_bm;
+}
 
-	// Check if we are armed.
-	if (armed) {
-		// Reset the button state.
-		PWM_SetColor(idle_color);
-		armed = false;
-	}
+/**
+ * Interrupt service routine that's called when a pin in PORTC changes.
+ */
+ISR(PORTC_PORT_vect) {
+	// Debounce the switch. The main loop takes care of the resulting events.
+	Button_HandleEdge();
 	
 	// Clear the interrupt flag.
 	PORTC.INTFLAGS |= WALL_SW;
@@ -342,7 +1260,4 @@ void GPIO_Initialize(void) {
 	PORTA.DIRSET = (PWM_B | PWM_W);
 	PORTB.DIRSET = (PWM_R | PWM_G | TXD | TX_EN);
 	PORTC.DIRSET = (STATUS_LED);
-	
-	// Setup the input interrupt for the button.
-	PORTC.PIN2CTRL = PORT_ISC_FALLING_gc;  // Trigger on the falling edge.
 }
\ No newline at end of file
@@ -8,24 +8,189 @@
 #include "nvmconfig.h"
 #include <avr/io.h>
 #include <avr/eeprom.h>
+#include <avr/pgmspace.h>
 #include <util/delay.h>
+#include <util/atomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include "crc.h"
+#include "profile.h"
 
-// Configuration variables in EEPROM.
-uint8_t EEMEM config_eeprom_our_addr = 1;
-int8_t EEMEM config_eeprom_clock_cal = 0;
+// Configuration slots and effect program in EEPROM.
+config_eeprom_t EEMEM config_eeprom;
 
-// Configuration variables in SRAM.
-static volatile uint8_t config_our_addr;
-static volatile int8_t config_clock_cal;
+// Configuration used when the one in EEPROM isn't valid.
+static const config_t config_defaults PROGMEM = {
+	CONFIG_VERSION,
+	0,                   // seq
+	1,                   // our_addr
+	0,                   // clock_cal
+	0,                   // baud (UART_BAUD_9600)
+	0,                   // groups
+	{ 0, 0, 0 },         // idle_color
+	{ 0, 0, 0 },         // act_color
+	0,                   // fade_time (Set by the application)
+	0,                   // flags
+	0,                   // fx_len
+	0,                   // fx_loops
+	0                    // crc
+};
+
+// EEPROM write queue entry.
+typedef struct {
+	uint8_t addr;
+	uint8_t data;
+} config_write_t;
+
+// EEPROM write queue.
+#define CONFIG_WRITE_QUEUE_MASK (CONFIG_WRITE_QUEUE_LEN - 1)
+static config_write_t config_wq[CONFIG_WRITE_QUEUE_LEN];
+static volatile uint8_t config_wq_head;
+static volatile uint8_t config_wq_tail;
+
+// Configuration in SRAM.
+static config_t config;
+static uint8_t config_slot;
+static bool config_dirty;
+static uint16_t config_dirty_ticks;
+
+// Private methods.
+static uint8_t Config_CRC(const config_t *cfg);
+static bool Config_IsValid(const config_t *cfg);
+static bool Config_IsStored(const config_t *cfg, uint8_t slot);
+static void Config_MarkDirty(void);
+static uint8_t Config_ReadByte(const void *src);
+static void Config_Read(void *dst, const void *src, uint8_t len);
+static void Config_Write(void *dst, const void *src, uint8_t len);
+
+/**
+ * Initializes the configuration EEPROM stuff and reads the latest valid
+ * configuration record from it, falling back to the defaults if there isn't
+ * one.
+ * 
+ * @return TRUE if a valid configuration was loaded from the EEPROM.
+ */
+bool Config_Initialize(void) {
+	config_t slot;
+	bool found = false;
+	uint8_t i;
+	
+	config_dirty = false;
+	config_wq_head = 0;
+	config_wq_tail = 0;
+	
+	// Pick the valid record with the newest sequence number.
+	for (i = 0; i < CONFIG_SLOTS; i++) {
+		eeprom_read_block(&slot, &config_eeprom.slots[i], sizeof(config_t));
+		if (!Config_IsValid(&slot))
+			continue;
+		if (found && ((int8_t)(slot.seq - config.seq) <= 0))
+			continue;
+		
+		config = slot;
+		config_slot = i;
+		found = true;
+	}
+	
+	if (found)
+		return true;
+	
+	// Nothing usable, so start over with the first slot.
+	memcpy_P(&config, &config_defaults, sizeof(config_t));
+	config_slot = CONFIG_SLOTS - 1;
+	return false;
+}
 
 /**
- * Initializes the configuration EEPROM stuff and reads all of the values that
- * we have in it.
+ * Writes the configuration back to the EEPROM once it has been left alone for
+ * a while. Should be called from the main loop.
  */
-void Config_Initialize(void) {
-	config_our_addr = eeprom_read_byte(&config_eeprom_our_addr);
-	config_clock_cal = (int8_t)eeprom_read_byte(&config_eeprom_clock_cal);
+void Config_Task(void) {
+	if (!config_dirty)
+		return;
+	
+	if ((uint16_t)(RTC_GetTicks() - config_dirty_ticks) >= CONFIG_COMMIT_DELAY)
+		Config_Commit();
+}
+
+/**
+ * Writes the configuration back to the next EEPROM slot right away if it has
+ * changed.
+ */
+void Config_Commit(void) {
+	if (!config_dirty)
+		return;
+	config_dirty = false;
+	
+	// Don't wear out a slot if we ended up where we started.
+	config.crc = Config_CRC(&config);
+	if (Config_IsStored(&config, config_slot))
+		return;
+	
+	config_slot = (config_slot + 1) % CONFIG_SLOTS;
+	config.seq++;
+	config.crc = Config_CRC(&config);
+	Config_Write(&config_eeprom.slots[config_slot], &config, sizeof(config_t));
+}
+
+/**
+ * Checks if there are configuration changes that haven't been written to the
+ * EEPROM yet.
+ * 
+ * @return TRUE if there are pending changes.
+ */
+bool Config_IsDirty(void) {
+	return config_dirty;
+}
+
+/**
+ * Checks if there are EEPROM writes queued up or in progress.
+ * 
+ * @return TRUE if the EEPROM is still being written to.
+ */
+bool Config_IsWriting(void) {
+	return NVMCTRL.INTCTRL & NVMCTRL_EEREADY_bm;
+}
+
+/**
+ * Handles the EEPROM ready interrupt by programming the next run of queued
+ * bytes that share an EEPROM page, skipping the ones that haven't changed, and
+ * disabling the interrupt once the queue is empty.
+ */
+void Config_HandleWriteReady(void) {
+	const config_write_t *w;
+	volatile uint8_t *ee;
+	uint8_t last = 0;
+	bool loaded = false;
+	PROF_START(prof);
+	
+	// Load the page buffer.
+	while (config_wq_tail != config_wq_head) {
+		w = &config_wq[config_wq_tail & CONFIG_WRITE_QUEUE_MASK];
+		ee = (volatile uint8_t *)(MAPPED_EEPROM_START + w->addr);
+		
+		// Each page write can only take ascending addresses in a single page.
+		if (loaded && ((w->addr <= last) ||
+				((w->addr / EEPROM_PAGE_SIZE) != (last / EEPROM_PAGE_SIZE)))) {
+			break;
+		}
+		
+		if (*ee != w->data) {
+			*ee = w->data;
+			last = w->addr;
+			loaded = true;
+		}
+		config_wq_tail++;
+	}
+	
+	// Program the page or stop if there's nothing left to do.
+	if (loaded) {
+		_PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, NVMCTRL_CMD_PAGEERASEWRITE_gc);
+	} else {
+		NVMCTRL.INTCTRL &= ~NVMCTRL_EEREADY_bm;
+	}
+	
+	PROF_END(PROF_EEPROM, prof);
 }
 
 /**
@@ -34,17 +199,18 @@ void Config_Initialize(void) {
  * @return Bus address.
  */
 uint8_t Config_GetOurAddress(void) {
-	return config_our_addr;
+	return config.our_addr;
 }
 
 /**
- * Sets our assigned bus address to the EEPROM.
+ * Sets our assigned bus address.
  * 
  * @param addr Our new bus address.
  */
 void Config_SetOurAddress(uint8_t addr) {
-	eeprom_update_byte(&config_eeprom_our_addr, addr);
-	config_our_addr = addr;
+	config.our_addr = addr;
+	config.flags |= CONFIG_FLAG_ADDR_SET;
+	Config_MarkDirty();
 }
 
 /**
@@ -53,7 +219,7 @@ void Config_SetOurAddress(uint8_t addr) {
  * @return Clock calibration factor constant.
  */
 int8_t Config_GetClockCalFactor(void) {
-	return config_clock_cal;
+	return config.clock_cal;
 }
 
 /**
@@ -62,6 +228,317 @@ int8_t Config_GetClockCalFactor(void) {
  * @param factor Clock calibration factor constant.
  */
 void Config_SetClockCalFactor(int8_t factor) {
-	eeprom_update_byte(&config_eeprom_clock_cal, factor);
-	config_clock_cal = factor;
+	config.clock_cal = factor;
+	Config_MarkDirty();
+}
+
+/**
+ * Gets the last baud rate that was known to work on the bus.
+ * 
+ * @return Baud rate from the uart_baud_t enum.
+ */
+uint8_t Config_GetBaudRate(void) {
+	return config.baud;
+}
+
+/**
+ * Sets the baud rate that we should use on the bus from now on.
+ * 
+ * @param baud Baud rate from the uart_baud_t enum.
+ */
+void Config_SetBaudRate(uint8_t baud) {
+	config.baud = baud;
+	Config_MarkDirty();
+}
+
+/**
+ * Gets the groups that we are a member of.
+ * 
+ * @return Bitmask of group memberships.
+ */
+uint16_t Config_GetGroups(void) {
+	uint16_t groups;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		groups = config.groups;
+	}
+	
+	return groups;
+}
+
+/**
+ * Sets the groups that we are a member of.
+ * 
+ * @param groups Bitmask of group memberships.
+ */
+void Config_SetGroups(uint16_t groups) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		config.groups = groups;
+	}
+	Config_MarkDirty();
+}
+
+/**
+ * Gets the color that is shown while we are idle.
+ * 
+ * @return Idle color.
+ */
+rgb_t Config_GetIdleColor(void) {
+	return config.idle_color;
+}
+
+/**
+ * Sets the color that is shown while we are idle.
+ * 
+ * @param color Idle color.
+ */
+void Config_SetIdleColor(rgb_t color) {
+	config.idle_color = color;
+	Config_MarkDirty();
+}
+
+/**
+ * Gets the color that is shown while we are armed.
+ * 
+ * @return Actuated color.
+ */
+rgb_t Config_GetActuatedColor(void) {
+	return config.act_color;
+}
+
+/**
+ * Sets the color that is shown while we are armed.
+ * 
+ * @param color Actuated color.
+ */
+void Config_SetActuatedColor(rgb_t color) {
+	config.act_color = color;
+	Config_MarkDirty();
+}
+
+/**
+ * Gets the time it takes to transition between the idle and actuated colors.
+ * 
+ * @return Fade time in milliseconds.
+ */
+uint16_t Config_GetFadeTime(void) {
+	return config.fade_time;
+}
+
+/**
+ * Sets the time it takes to transition between the idle and actuated colors.
+ * 
+ * @param ms Fade time in milliseconds.
+ */
+void Config_SetFadeTime(uint16_t ms) {
+	config.fade_time = ms;
+	Config_MarkDirty();
+}
+
+/**
+ * Checks if a configuration flag is set.
+ * 
+ * @param  flag One of the CONFIG_FLAG_ bits.
+ * @return      TRUE if the flag is set.
+ */
+bool Config_GetFlag(uint8_t flag) {
+	return (config.flags & flag) != 0;
+}
+
+/**
+ * Sets or clears a configuration flag.
+ * 
+ * @param flag One of the CONFIG_FLAG_ bits.
+ * @param set  Should the flag be set?
+ */
+void Config_SetFlag(uint8_t flag, bool set) {
+	if (set) {
+		config.flags |= flag;
+	} else {
+		config.flags &= ~flag;
+	}
+	Config_MarkDirty();
+}
+
+/**
+ * Gets the number of keyframes in the effect program.
+ * 
+ * @return Number of keyframes.
+ */
+uint8_t Config_GetEffectLength(void) {
+	return config.fx_len;
+}
+
+/**
+ * Gets how many times the effect program should be played.
+ * 
+ * @return Number of times to play the program or 0 for forever.
+ */
+uint8_t Config_GetEffectLoops(void) {
+	return config.fx_loops;
+}
+
+/**
+ * Sets the number of keyframes in the effect program and how many times it
+ * should be played.
+ * 
+ * @param len   Number of keyframes.
+ * @param loops Number of times to play the program or 0 for forever.
+ */
+void Config_SetEffectLength(uint8_t len, uint8_t loops) {
+	config.fx_len = len;
+	config.fx_loops = loops;
+	Config_MarkDirty();
+}
+
+/**
+ * Gets a keyframe of the effect program.
+ * 
+ * @param index Index of the keyframe.
+ * @param kf    Keyframe structure to be populated.
+ */
+void Config_GetEffectKeyframe(uint8_t index, fx_keyframe_t *kf) {
+	Config_Read(kf, &config_eeprom.fx_keyframes[index], sizeof(fx_keyframe_t));
+}
+
+/**
+ * Sets a keyframe of the effect program. Keyframes aren't part of the
+ * configuration record, so this gets written to the EEPROM right away.
+ * 
+ * @param index Index of the keyframe.
+ * @param kf    Keyframe to be stored.
+ */
+void Config_SetEffectKeyframe(uint8_t index, const fx_keyframe_t *kf) {
+	Config_Write(&config_eeprom.fx_keyframes[index], kf, sizeof(fx_keyframe_t));
+}
+
+/**
+ * Calculates the CRC of a configuration record.
+ * 
+ * @param  cfg Configuration record.
+ * @return     CRC-8 of everything in the record except the CRC itself.
+ */
+static uint8_t Config_CRC(const config_t *cfg) {
+	const uint8_t *p = (const uint8_t *)cfg;
+	uint8_t crc = CRC8_INIT;
+	uint8_t i;
+	
+	for (i = 0; i < offsetof(config_t, crc); i++)
+		crc = CRC8_Update(crc, p[i]);
+	
+	return crc;
+}
+
+/**
+ * Checks if a configuration record was written by us and survived intact.
+ * 
+ * @param  cfg Configuration record.
+ * @return     TRUE if the record can be used.
+ */
+static bool Config_IsValid(const config_t *cfg) {
+	return (cfg->version == CONFIG_VERSION) &&
+		(cfg->crc == Config_CRC(cfg)) &&
+		(cfg->fx_len <= FX_KEYFRAMES_MAX);
+}
+
+/**
+ * Checks if a configuration record is identical to the one in an EEPROM slot.
+ * 
+ * @param  cfg  Configuration record.
+ * @param  slot Index of the EEPROM slot.
+ * @return      TRUE if the slot already holds this exact record.
+ */
+static bool Config_IsStored(const config_t *cfg, uint8_t slot) {
+	const uint8_t *p = (const uint8_t *)cfg;
+	const uint8_t *ee = (const uint8_t *)&config_eeprom.slots[slot];
+	uint8_t i;
+	
+	for (i = 0; i < sizeof(config_t); i++) {
+		if (Config_ReadByte(ee + i) != p[i])
+			return false;
+	}
+	
+	return true;
+}
+
+/**
+ * Flags the configuration as changed and restarts the quiet period before it
+ * gets written back to the EEPROM.
+ */
+static void Config_MarkDirty(void) {
+	config_dirty = true;
+	config_dirty_ticks = RTC_GetTicks();
+}
+
+/**
+ * Reads a byte from the EEPROM, taking into account any writes to it that are
+ * still waiting in the queue.
+ * 
+ * @param  src Address of the byte in EEPROM.
+ * @return     Value of the byte.
+ */
+static uint8_t Config_ReadByte(const void *src) {
+	uint8_t addr = (uint8_t)(uint16_t)src;
+	uint8_t data;
+	bool queued = false;
+	uint8_t i;
+	
+	// Newest queued write wins.
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		for (i = config_wq_tail; i != config_wq_head; i++) {
+			if (config_wq[i & CONFIG_WRITE_QUEUE_MASK].addr == addr) {
+				data = config_wq[i & CONFIG_WRITE_QUEUE_MASK].data;
+				queued = true;
+			}
+		}
+	}
+	
+	// Nothing pending for it, so the EEPROM has the latest value.
+	if (!queued)
+		data = *(volatile uint8_t *)(MAPPED_EEPROM_START + addr);
+	
+	return data;
+}
+
+/**
+ * Reads a value from the EEPROM, taking into account any writes to it that are
+ * still waiting in the queue.
+ * 
+ * @param dst Buffer to store the value in.
+ * @param src Address of the value in EEPROM.
+ * @param len Length of the value in bytes.
+ */
+static void Config_Read(void *dst, const void *src, uint8_t len) {
+	uint8_t *p = (uint8_t *)dst;
+	const uint8_t *ee = (const uint8_t *)src;
+	
+	while (len--)
+		*p++ = Config_ReadByte(ee++);
+}
+
+/**
+ * Queues a value to be written to the EEPROM in the background. This only
+ * blocks if the queue is full.
+ * 
+ * @param dst Address of the value in EEPROM.
+ * @param src Value to be written.
+ * @param len Length of the value in bytes.
+ */
+static void Config_Write(void *dst, const void *src, uint8_t len) {
+	const uint8_t *p = (const uint8_t *)src;
+	uint8_t addr = (uint8_t)(uint16_t)dst;
+	config_write_t *w;
+	
+	while (len--) {
+		// Wait for the interrupt to make some room.
+		while ((uint8_t)(config_wq_head - config_wq_tail) == CONFIG_WRITE_QUEUE_LEN)
+			;
+		
+		w = &config_wq[config_wq_head & CONFIG_WRITE_QUEUE_MASK];
+		w->addr = addr++;
+		w->data = *p++;
+		config_wq_head++;
+		
+		NVMCTRL.INTCTRL |= NVMCTRL_EEREADY_bm;
+	}
 }
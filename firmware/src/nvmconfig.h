@@ -12,20 +12,96 @@
 extern "C" {
 #endif
 
+#include <avr/io.h>
 #include <inttypes.h>
+#include <stdbool.h>
+#include "rtc.h"
+#include "pwm.h"
+#include "effects.h"
+
+// Some definitions.
+#define CONFIG_VERSION      2  // Bump whenever config_t changes.
+#define CONFIG_COMMIT_DELAY (2 * RTC_TICKS_PER_SEC)  // Quiet period in ticks.
+
+/**
+ * Number of EEPROM slots that the configuration record rotates through, with
+ * each commit going to the slot after the last one, so every cell only sees a
+ * fraction of the writes and a torn write never takes out the previous record.
+ * These, plus the effect keyframes, must fit in the 128 bytes of EEPROM.
+ */
+#define CONFIG_SLOTS 4
+
+/**
+ * Number of bytes that can be waiting to be written to the EEPROM. Must be a
+ * power of 2 and hold at least a full record plus a keyframe.
+ */
+#define CONFIG_WRITE_QUEUE_LEN 32
+
+// Configuration flags.
+#define CONFIG_FLAG_ANNC_PRESS   _BV(0)
+#define CONFIG_FLAG_ANNC_RELEASE _BV(1)
+#define CONFIG_FLAG_ADDR_SET     _BV(2)  // Address was explicitly assigned.
+
+// Configuration record.
+typedef struct {
+	uint8_t version;
+	uint8_t seq;
+	uint8_t our_addr;
+	int8_t clock_cal;
+	uint8_t baud;
+	uint16_t groups;
+	rgb_t idle_color;
+	rgb_t act_color;
+	uint16_t fade_time;
+	uint8_t flags;
+	uint8_t fx_len;
+	uint8_t fx_loops;
+	uint8_t crc;
+} config_t;
+
+// Everything in EEPROM. (A single object, so the bootloader knows where it is)
+typedef struct {
+	config_t slots[CONFIG_SLOTS];
+	fx_keyframe_t fx_keyframes[FX_KEYFRAMES_MAX];
+} config_eeprom_t;
 	
 // Initialization
-void Config_Initialize(void);
+bool Config_Initialize(void);
+
+// Write-back
+void Config_Task(void);
+void Config_Commit(void);
+bool Config_IsDirty(void);
+bool Config_IsWriting(void);
+void Config_HandleWriteReady(void);
 
 // Getters and Setters
 uint8_t Config_GetOurAddress(void);
 void Config_SetOurAddress(uint8_t addr);
 int8_t Config_GetClockCalFactor(void);
 void Config_SetClockCalFactor(int8_t factor);
+uint8_t Config_GetBaudRate(void);
+void Config_SetBaudRate(uint8_t baud);
+uint16_t Config_GetGroups(void);
+void Config_SetGroups(uint16_t groups);
+rgb_t Config_GetIdleColor(void);
+void Config_SetIdleColor(rgb_t color);
+rgb_t Config_GetActuatedColor(void);
+void Config_SetActuatedColor(rgb_t color);
+uint16_t Config_GetFadeTime(void);
+void Config_SetFadeTime(uint16_t ms);
+bool Config_GetFlag(uint8_t flag);
+void Config_SetFlag(uint8_t flag, bool set);
+
+// Effect program
+uint8_t Config_GetEffectLength(void);
+uint8_t Config_GetEffectLoops(void);
+void Config_SetEffectLength(uint8_t len, uint8_t loops);
+void Config_GetEffectKeyframe(uint8_t index, fx_keyframe_t *kf);
+void Config_SetEffectKeyframe(uint8_t index, const fx_keyframe_t *kf);
 
 #ifdef	__cplusplus
 }
 #endif
 
 #endif	/* NVMCONFIG_H */
-
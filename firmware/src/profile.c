@@ -0,0 +1,76 @@
+/**
+ * profile.c
+ * Optional hot path profiling using a spare timer.
+ * 
+ * TCB0 is left free running at half the CPU clock, so sections can be timed
+ * with a 2 cycle resolution up to about 6.5ms. Nested sections (like the RX
+ * interrupt firing while we are parsing a frame) are included in the time of
+ * the section that they interrupted.
+ * 
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include "profile.h"
+
+#ifdef PROF_ENABLED
+#include <util/atomic.h>
+
+// Private variables.
+static volatile prof_stats_t prof_stats[PROF_SECTIONS_NUM];
+
+/**
+ * Sets up the profiling timer and resets the statistics.
+ */
+void Prof_Initialize(void) {
+	Prof_Reset();
+	
+	TCB0.CCMP = 0xFFFF;
+	TCB0.CTRLB = TCB_CNTMODE_INT_gc;
+	TCB0.CTRLA = TCB_CLKSEL_CLKDIV2_gc | TCB_ENABLE_bm;
+}
+
+/**
+ * Records how long a section took to run.
+ * 
+ * @param section Profiled section from the prof_section_t enum.
+ * @param ticks   Timer ticks that the section took.
+ */
+void Prof_Record(uint8_t section, uint16_t ticks) {
+	volatile prof_stats_t *stats = &prof_stats[section];
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (ticks < stats->min)
+			stats->min = ticks;
+		if (ticks > stats->max)
+			stats->max = ticks;
+		stats->last = ticks;
+	}
+}
+
+/**
+ * Gets the timing statistics of a section.
+ * 
+ * @param section Profiled section from the prof_section_t enum.
+ * @param stats   Statistics structure to be populated.
+ */
+void Prof_GetStats(uint8_t section, prof_stats_t *stats) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		stats->min = prof_stats[section].min;
+		stats->max = prof_stats[section].max;
+		stats->last = prof_stats[section].last;
+	}
+}
+
+/**
+ * Resets the timing statistics of every section.
+ */
+void Prof_Reset(void) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		for (uint8_t i = 0; i < PROF_SECTIONS_NUM; i++) {
+			prof_stats[i].min = 0xFFFF;
+			prof_stats[i].max = 0;
+			prof_stats[i].last = 0;
+		}
+	}
+}
+#endif  /* PROF_ENABLED */
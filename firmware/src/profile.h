@@ -0,0 +1,61 @@
+/**
+ * profile.h
+ * Optional hot path profiling using a spare timer.
+ * 
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef PROFILE_H
+#define	PROFILE_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <avr/io.h>
+#include <inttypes.h>
+
+// Uncomment to enable profiling. No code is emitted for it otherwise.
+//#define PROF_ENABLED
+
+// Profiled sections.
+typedef enum {
+	PROF_RX_ISR,
+	PROF_PARSE,
+	PROF_DISPATCH,
+	PROF_REPLY,
+	PROF_EEPROM,
+	PROF_SECTIONS_NUM
+} prof_section_t;
+
+#ifdef PROF_ENABLED
+// Section timing statistics in timer ticks. (2 CPU cycles each)
+typedef struct {
+	uint16_t min;
+	uint16_t max;
+	uint16_t last;
+} prof_stats_t;
+
+// Instrumentation
+#define PROF_INIT()              Prof_Initialize()
+#define PROF_START(var)          uint16_t var = TCB0.CNT
+#define PROF_STAMP(var)          var = TCB0.CNT
+#define PROF_END(section, var)   Prof_Record((section), TCB0.CNT - (var))
+
+// Profiling
+void Prof_Initialize(void);
+void Prof_Record(uint8_t section, uint16_t ticks);
+void Prof_GetStats(uint8_t section, prof_stats_t *stats);
+void Prof_Reset(void);
+#else
+#define PROF_INIT()
+#define PROF_START(var)
+#define PROF_STAMP(var)
+#define PROF_END(section, var)
+#endif  /* PROF_ENABLED */
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* PROFILE_H */
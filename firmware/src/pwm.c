@@ -9,8 +9,52 @@
 #include "global_pins.h"
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include <util/delay.h>
 
+// Private definitions.
+#define PWM_TICKS_PER_SEC (F_CPU / 256UL / 256UL)  // Timer underflow rate.
+
+// Fade state structure.
+typedef struct {
+	rgbw_t from;
+	rgbw_t to;
+	uint16_t pos;
+	uint16_t pos_inc;
+	uint16_t steps_left;
+	uint8_t easing;
+} pwm_fade_t;
+
+// Private variables.
+static volatile rgbw_t pwm_color;
+static volatile pwm_fade_t pwm_fade;
+
+// Gamma correction table. (gamma = 2.2)
+static const uint8_t pwm_gamma[256] PROGMEM = {
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   1,
+	  1,   1,   1,   1,   1,   1,   1,   1,   1,   2,   2,   2,   2,   2,   2,   2,
+	  3,   3,   3,   3,   3,   4,   4,   4,   4,   5,   5,   5,   5,   6,   6,   6,
+	  6,   7,   7,   7,   8,   8,   8,   9,   9,   9,  10,  10,  11,  11,  11,  12,
+	 12,  13,  13,  13,  14,  14,  15,  15,  16,  16,  17,  17,  18,  18,  19,  19,
+	 20,  20,  21,  22,  22,  23,  23,  24,  25,  25,  26,  26,  27,  28,  28,  29,
+	 30,  30,  31,  32,  33,  33,  34,  35,  35,  36,  37,  38,  39,  39,  40,  41,
+	 42,  43,  43,  44,  45,  46,  47,  48,  49,  49,  50,  51,  52,  53,  54,  55,
+	 56,  57,  58,  59,  60,  61,  62,  63,  64,  65,  66,  67,  68,  69,  70,  71,
+	 73,  74,  75,  76,  77,  78,  79,  81,  82,  83,  84,  85,  87,  88,  89,  90,
+	 91,  93,  94,  95,  97,  98,  99, 100, 102, 103, 105, 106, 107, 109, 110, 111,
+	113, 114, 116, 117, 119, 120, 121, 123, 124, 126, 127, 129, 130, 132, 133, 135,
+	137, 138, 140, 141, 143, 145, 146, 148, 149, 151, 153, 154, 156, 158, 159, 161,
+	163, 165, 166, 168, 170, 172, 173, 175, 177, 179, 181, 182, 184, 186, 188, 190,
+	192, 194, 196, 197, 199, 201, 203, 205, 207, 209, 211, 213, 215, 217, 219, 221,
+	223, 225, 227, 229, 231, 234, 236, 238, 240, 242, 244, 246, 248, 251, 253, 255
+};
+
+// Private methods.
+static void PWM_StartFade(rgbw_t color, uint16_t ms, uint8_t easing);
+static uint8_t PWM_Ease(uint8_t t);
+static uint8_t PWM_Lerp(uint8_t from, uint8_t to, uint8_t t);
+static void PWM_Output(void);
+
 /**
  * Initializes the PWM peripheral and gets everything ready for das blinken
  * lights.
@@ -92,24 +136,211 @@ void PWM_SetRGBW(uint8_t r, uint8_t g, uint8_t b, uint8_t w) {
 }
 
 /**
- * Sets the duty cycle of all our color PWM channels.
+ * Sets a gamma corrected color immediately, stopping any fades in progress.
+ * The white channel is left untouched.
  * 
  * @param color RGB color structure.
  */
 void PWM_SetColor(rgb_t color) {
-	PWM_SetRed(color.r);
-	PWM_SetGreen(color.g);
-	PWM_SetBlue(color.b);
+	PWM_FadeToColor(color, 0);
 }
 
 /**
- * Sets the duty cycle of all our color PWM channels including white.
+ * Sets a gamma corrected color including white immediately, stopping any fades
+ * in progress.
  * 
  * @param color RGBW color structure.
  */
 void PWM_SetColorW(rgbw_t color) {
-	PWM_SetRed(color.r);
-	PWM_SetGreen(color.g);
-	PWM_SetBlue(color.b);
-	PWM_SetWhite(color.w);
+	PWM_FadeToColorW(color, 0);
+}
+
+/**
+ * Smoothly fades from the current color to a new one. The white channel is
+ * left untouched.
+ * 
+ * @param color RGB color structure to fade to.
+ * @param ms    Duration of the fade in milliseconds.
+ */
+void PWM_FadeToColor(rgb_t color, uint16_t ms) {
+	PWM_FadeToColorEase(color, ms, PWM_EASE_LINEAR);
+}
+
+/**
+ * Smoothly fades from the current color to a new one including white. The
+ * colors are interpolated linearly and gamma corrected on their way out.
+ * 
+ * @param color RGBW color structure to fade to.
+ * @param ms    Duration of the fade in milliseconds.
+ */
+void PWM_FadeToColorW(rgbw_t color, uint16_t ms) {
+	PWM_StartFade(color, ms, PWM_EASE_LINEAR);
+}
+
+/**
+ * Fades from the current color to a new one following an easing curve. The
+ * white channel is left untouched.
+ * 
+ * @param color  RGB color structure to fade to.
+ * @param ms     Duration of the fade in milliseconds.
+ * @param easing Easing curve from the pwm_easing_t enum.
+ */
+void PWM_FadeToColorEase(rgb_t color, uint16_t ms, uint8_t easing) {
+	rgbw_t target;
+	
+	target.r = color.r;
+	target.g = color.g;
+	target.b = color.b;
+	target.w = pwm_fade.to.w;
+	
+	PWM_StartFade(target, ms, easing);
+}
+
+/**
+ * Starts fading from the current color to a new one.
+ * 
+ * @param color  RGBW color structure to fade to.
+ * @param ms     Duration of the fade in milliseconds.
+ * @param easing Easing curve from the pwm_easing_t enum.
+ */
+static void PWM_StartFade(rgbw_t color, uint16_t ms, uint8_t easing) {
+	uint32_t steps;
+	
+	// Stop the fade engine while we mess with it.
+	TCA0.SPLIT.INTCTRL = 0;
+	
+	// Fade from wherever we are right now.
+	pwm_fade.from.r = pwm_color.r;
+	pwm_fade.from.g = pwm_color.g;
+	pwm_fade.from.b = pwm_color.b;
+	pwm_fade.from.w = pwm_color.w;
+	pwm_fade.to.r = color.r;
+	pwm_fade.to.g = color.g;
+	pwm_fade.to.b = color.b;
+	pwm_fade.to.w = color.w;
+	pwm_fade.easing = easing;
+	
+	// Calculate how many timer ticks the fade will take.
+	steps = ((uint32_t)ms * PWM_TICKS_PER_SEC) / 1000;
+	if (steps > UINT16_MAX)
+		steps = UINT16_MAX;
+	
+	// Just set the color if there's nothing to fade.
+	if (steps <= 1) {
+		pwm_fade.steps_left = 0;
+		pwm_color.r = color.r;
+		pwm_color.g = color.g;
+		pwm_color.b = color.b;
+		pwm_color.w = color.w;
+		PWM_Output();
+		
+		return;
+	}
+	
+	// Start the fade engine.
+	pwm_fade.pos = 0;
+	pwm_fade.pos_inc = UINT16_MAX / steps;
+	pwm_fade.steps_left = steps;
+	TCA0.SPLIT.INTFLAGS = TCA_SPLIT_LUNF_bm;
+	TCA0.SPLIT.INTCTRL = TCA_SPLIT_LUNF_bm;
+}
+
+/**
+ * Checks if we are in the middle of a fade.
+ * 
+ * @return TRUE if a fade is in progress.
+ */
+bool PWM_IsFading(void) {
+	return TCA0.SPLIT.INTCTRL & TCA_SPLIT_LUNF_bm;
+}
+
+/**
+ * Advances the fade engine. Should be called from the timer low byte underflow
+ * interrupt.
+ */
+void PWM_HandleFadeTick(void) {
+	uint8_t t;
+	
+	// Are we done?
+	if (--pwm_fade.steps_left == 0) {
+		TCA0.SPLIT.INTCTRL = 0;
+		pwm_color.r = pwm_fade.to.r;
+		pwm_color.g = pwm_fade.to.g;
+		pwm_color.b = pwm_fade.to.b;
+		pwm_color.w = pwm_fade.to.w;
+		PWM_Output();
+		
+		return;
+	}
+	
+	// Interpolate the colors.
+	pwm_fade.pos += pwm_fade.pos_inc;
+	t = PWM_Ease(pwm_fade.pos >> 8);
+	pwm_color.r = PWM_Lerp(pwm_fade.from.r, pwm_fade.to.r, t);
+	pwm_color.g = PWM_Lerp(pwm_fade.from.g, pwm_fade.to.g, t);
+	pwm_color.b = PWM_Lerp(pwm_fade.from.b, pwm_fade.to.b, t);
+	pwm_color.w = PWM_Lerp(pwm_fade.from.w, pwm_fade.to.w, t);
+	PWM_Output();
+}
+
+/**
+ * Applies the current fade's easing curve to its position.
+ * 
+ * @param  t Linear position in the fade from 0 to 255.
+ * @return   Eased position in the fade from 0 to 255.
+ */
+static uint8_t PWM_Ease(uint8_t t) {
+	uint8_t r = 255 - t;
+	
+	switch (pwm_fade.easing) {
+		case PWM_EASE_IN:
+			return ((uint16_t)t * t) >> 8;
+		case PWM_EASE_OUT:
+			return 255 - (((uint16_t)r * r) >> 8);
+		case PWM_EASE_IN_OUT:
+			if (t < 128)
+				return ((uint16_t)t * t) >> 7;
+			return 255 - (((uint16_t)r * r) >> 7);
+		case PWM_EASE_STEP:
+			return 255;
+	}
+	
+	return t;
+}
+
+/**
+ * Linearly interpolates between two channel values.
+ * 
+ * @param  from Starting value.
+ * @param  to   Final value.
+ * @param  t    Position between them from 0 to 255.
+ * @return      Interpolated value.
+ */
+static uint8_t PWM_Lerp(uint8_t from, uint8_t to, uint8_t t) {
+	// Keep the math unsigned since 255 * 255 doesn't fit in an int16_t.
+	if (to >= from)
+		return from + (((uint16_t)(to - from) * t) >> 8);
+	
+	return from - (((uint16_t)(from - to) * t) >> 8);
+}
+
+/**
+ * Sends the current color to the PWM channels with gamma correction applied.
+ */
+static void PWM_Output(void) {
+	PWM_SetRed(pgm_read_byte(&pwm_gamma[pwm_color.r]));
+	PWM_SetGreen(pgm_read_byte(&pwm_gamma[pwm_color.g]));
+	PWM_SetBlue(pgm_read_byte(&pwm_gamma[pwm_color.b]));
+	PWM_SetWhite(pgm_read_byte(&pwm_gamma[pwm_color.w]));
+}
+
+/**
+ * Checks if all of our PWM channels are completely off and will stay that way,
+ * which means that the timer doesn't need to keep running.
+ * 
+ * @return TRUE if all of the channels are off and we aren't fading.
+ */
+bool PWM_IsOff(void) {
+	return !PWM_IsFading() && !(TCA0.SPLIT.LCMP0 | TCA0.SPLIT.LCMP1 |
+		TCA0.SPLIT.HCMP1 | TCA0.SPLIT.HCMP2);
 }
@@ -13,6 +13,7 @@ extern "C" {
 #endif
 
 #include <inttypes.h>
+#include <stdbool.h>
 
 // RGB color structure.
 typedef struct {
@@ -28,6 +29,16 @@ typedef struct {
 	uint8_t b;
 	uint8_t w;
 } rgbw_t;
+
+// Fade easing curves.
+typedef enum {
+	PWM_EASE_LINEAR,
+	PWM_EASE_IN,
+	PWM_EASE_OUT,
+	PWM_EASE_IN_OUT,
+	PWM_EASE_STEP,
+	PWM_EASE_NUM
+} pwm_easing_t;
 	
 // Initialization
 void PWM_Initialize(void);
@@ -41,6 +52,14 @@ void PWM_SetRGB(uint8_t r, uint8_t g, uint8_t b);
 void PWM_SetRGBW(uint8_t r, uint8_t g, uint8_t b, uint8_t w);
 void PWM_SetColor(rgb_t color);
 void PWM_SetColorW(rgbw_t color);
+bool PWM_IsOff(void);
+
+// Fading
+void PWM_FadeToColor(rgb_t color, uint16_t ms);
+void PWM_FadeToColorW(rgbw_t color, uint16_t ms);
+void PWM_FadeToColorEase(rgb_t color, uint16_t ms, uint8_t easing);
+bool PWM_IsFading(void);
+void PWM_HandleFadeTick(void);
 
 #ifdef	__cplusplus
 }
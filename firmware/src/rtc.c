@@ -10,8 +10,13 @@
 #include "nvmconfig.h"
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <util/atomic.h>
 #include <util/delay.h>
 
+// Private variables.
+static volatile uint16_t rtc_ticks;
+static volatile uint16_t rtc_seconds;
+
 /**
  * Initializes the RTC peripheral.
  * 
@@ -37,10 +42,50 @@ void RTC_Initialize(uint16_t cmp_ms, uint16_t per_ms) {
 	
 	// PIT
 	RTC.PITINTCTRL = RTC_PI_bm;                 // Enable the PIT interrupt.
-	RTC.PITCTRLA   = (RTC_PERIOD_CYC32768_gc |  // Interrupt every second.
+	RTC.PITCTRLA   = (RTC_PERIOD_CYC128_gc |    // Interrupt every 1/256 of a second.
 			RTC_PITEN_bm);                      // Enable the PIT timer.
 }
 
+/**
+ * Advances our tick counter. Should be called from the PIT interrupt.
+ */
+void RTC_Tick(void) {
+	rtc_ticks++;
+	if ((rtc_ticks % RTC_TICKS_PER_SEC) == 0)
+		rtc_seconds++;
+}
+
+/**
+ * Gets the number of PIT ticks since we've started. This will wrap around
+ * every 65536 / RTC_TICKS_PER_SEC seconds.
+ * 
+ * @return Current tick count.
+ */
+uint16_t RTC_GetTicks(void) {
+	uint16_t ticks;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		ticks = rtc_ticks;
+	}
+	
+	return ticks;
+}
+
+/**
+ * Gets the number of seconds since we've started.
+ * 
+ * @return Uptime in seconds.
+ */
+uint16_t RTC_GetSeconds(void) {
+	uint16_t secs;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		secs = rtc_seconds;
+	}
+	
+	return secs;
+}
+
 /**
  * Sets up a timer.
  * 
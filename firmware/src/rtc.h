@@ -14,6 +14,9 @@ extern "C" {
 
 #include <stdbool.h>
 #include <inttypes.h>
+
+// Some definitions.
+#define RTC_TICKS_PER_SEC 256  // Rate of the PIT tick.
 	
 // Timer structure.
 typedef struct {
@@ -26,6 +29,11 @@ typedef struct {
 // Initialization
 void RTC_Initialize(uint16_t cmp_ms, uint16_t per_ms);
 
+// Ticks
+void RTC_Tick(void);
+uint16_t RTC_GetTicks(void);
+uint16_t RTC_GetSeconds(void);
+
 // Timer
 void RTC_Timer_Setup(rtc_timer_t *timer, bool continuous, uint8_t period);
 void RTC_Timer_Start(rtc_timer_t *timer);
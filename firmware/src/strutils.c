@@ -107,6 +107,29 @@ void u8toa(char *buf, uint8_t n) {
 	*tmp = '\0';
 }
 
+/**
+ * Converts a uint16_t to a string.
+ * 
+ * @param buf String big enough to be filled with the number.
+ * @param n   Number to be converted.
+ */
+void u16toa(char *buf, uint16_t n) {
+	char *tmp = buf;
+	uint8_t i = 0;
+	
+	// Go through the decades converting each digit into a character.
+	for (uint16_t d = 10000; d > 0; d /= 10) {
+		i = n / d;
+		n -= i * d;
+		
+		if ((i > 0) || (tmp != buf) || (d == 1))
+			*tmp++ = i + ASCII_0;
+	}
+	
+	// Terminate the string.
+	*tmp = '\0';
+}
+
 /**
  * Converts a int8_t to a string.
  * 
@@ -148,3 +171,34 @@ void strcomb(char *buf, const char *str1, const char *str2) {
 	// Properly terminate the buffer.
 	*tmp = '\0';
 }
+
+/**
+ * Converts an uint8_t into a string as 2 uppercase hexadecimal digits.
+ * 
+ * @param buf String buffer at least 3 characters long.
+ * @param n   Number to be converted.
+ */
+void u8tohex(char *buf, uint8_t n) {
+	static const char digits[] = "0123456789ABCDEF";
+	
+	buf[0] = digits[n >> 4];
+	buf[1] = digits[n & 0x0F];
+	buf[2] = '\0';
+}
+
+/**
+ * Converts a single hexadecimal digit into its value.
+ * 
+ * @param  c Hexadecimal digit in either case.
+ * @return   Value of the digit or -1 if it isn't a valid one.
+ */
+int8_t hexdigit(char c) {
+	if ((c >= ASCII_0) && (c <= ASCII_9))
+		return c - ASCII_0;
+	if ((c >= 'A') && (c <= 'F'))
+		return c - 'A' + 10;
+	if ((c >= 'a') && (c <= 'f'))
+		return c - 'a' + 10;
+	
+	return -1;
+}
@@ -18,7 +18,10 @@ extern "C" {
 int8_t atou8(uint8_t *n, const char *buf);
 int8_t atoi8(int8_t *n, const char *buf);
 void u8toa(char *buf, uint8_t n);
+void u16toa(char *buf, uint16_t n);
 void i8toa(char *buf, int8_t n);
+void u8tohex(char *buf, uint8_t n);
+int8_t hexdigit(char c);
 
 // String Manipulation
 void strcomb(char *buf, const char *str1, const char *str2);
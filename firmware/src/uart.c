@@ -11,43 +11,161 @@
 #include "nvmconfig.h"
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <stdlib.h>
+#include <avr/pgmspace.h>
 #include <util/delay.h>
+#include <util/atomic.h>
 
 // Private definitions.
-#define BAUDRATER(BAUD_RATE) ((float)((float)F_CPU * 64 /(16 *(float)BAUD_RATE))+ 0.5)
+#define BAUD_DIVISOR(BAUD_RATE) ((uint16_t)((((uint32_t)F_CPU * 4) + \
+	((BAUD_RATE) / 2)) / (BAUD_RATE)))
+#define UART_TX_BUF_LEN  32  // Must be a power of 2.
+#define UART_TX_BUF_MASK (UART_TX_BUF_LEN - 1)
+
+// Private variables.
+static volatile uint8_t uart_tx_buf[UART_TX_BUF_LEN];
+static volatile uint8_t uart_tx_head;
+static volatile uint8_t uart_tx_tail;
+static uint8_t uart_baud;
+static uint16_t uart_baud_div;
+static char *uart_cap_buf;
+static uint8_t uart_cap_len;
+static uint8_t uart_cap_max;
+static bool uart_cap_overflow;
+static uart_tap_t uart_tap;
+static volatile uint16_t uart_tx_bytes;
+
+// Baud rate divisors for each of the supported baud rates.
+static const uint16_t uart_baud_divisors[UART_BAUD_NUM] PROGMEM = {
+	BAUD_DIVISOR(9600),
+	BAUD_DIVISOR(19200),
+	BAUD_DIVISOR(38400),
+	BAUD_DIVISOR(57600),
+	BAUD_DIVISOR(115200)
+};
 
 /**
  * Sets up the UART peripheral for communication.
  * 
- * @param baud Desired baud rate.
+ * The clock calibration factor is given in divisor steps at 9600 baud and gets
+ * scaled to the selected baud rate, so a single calibration works for all of
+ * them.
+ * 
+ * @param baud Desired baud rate from the uart_baud_t enum.
  */
-void UART_Initialize(uint16_t baud) {
+void UART_Initialize(uint8_t baud) {
+	int32_t div;
+	
+	// Make sure we have a valid baud rate.
+	if (baud >= UART_BAUD_NUM)
+		baud = UART_BAUD_9600;
+	
+	// Calculate the corrected baud rate divisor.
+	div = pgm_read_word(&uart_baud_divisors[baud]);
+	div += ((div * (int8_t)SIGROW.OSC20ERR5V) / 1024) +
+		((div * Config_GetClockCalFactor()) / BAUD_DIVISOR(9600));
+	
+	// Make sure we don't change the baud rate in the middle of a transmission.
+	UART_Flush();
+	
 	// Disable interrupts while we set things up.
 	cli();
 	
+	uart_baud = baud;
+	uart_baud_div = (uint16_t)div;
 	PORTB.OUTCLR = TX_EN;                            // Make sure RS-485 bus is set to RX.
-	USART0.BAUD  = (uint16_t)((int32_t)BAUDRATER(baud) *
-			(1024 + (int8_t)SIGROW.OSC20ERR5V) / 1024) + Config_GetClockCalFactor();
-	USART0.CTRLA = USART_RXCIE_bm | USART_TXCIE_bm;  // Enable the TX and RX interrupt.
-	USART0.CTRLB = USART_RXEN_bm | USART_TXEN_bm;    // Enable transmitter and receiver.
+	USART0.BAUD  = (uint16_t)div;                    // Set the baud rate.
+	USART0.CTRLA = USART_RXCIE_bm | USART_TXCIE_bm | // Enable the TX and RX interrupt.
+		USART_ABEIE_bm;                              // Report bad sync fields.
+	USART0.CTRLB = USART_RXEN_bm | USART_TXEN_bm |   // Enable transmitter and receiver.
+		USART_SFDEN_bm |                             // Wake up from standby on a start bit.
+		USART_RXMODE_GENAUTO_gc;                     // Measure break and sync fields.
 	
 	// Enable interrupts again.
 	sei();
 }
 
+/**
+ * Gets the baud rate that we are currently operating at.
+ * 
+ * @return Current baud rate from the uart_baud_t enum.
+ */
+uint8_t UART_GetBaudRate(void) {
+	return uart_baud;
+}
+
+/**
+ * Turns the baud rate divisor that was last measured by the auto-baud hardware
+ * into a clock calibration factor and stores it if it has drifted away from
+ * the one we have. Should only be called after receiving a valid frame, so we
+ * know the measurement was a good one.
+ */
+void UART_TrackClockCal(void) {
+	int32_t base;
+	int32_t cal;
+	uint16_t div;
+	
+	// Check if the hardware has measured anything new.
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		div = USART0.BAUD;
+	}
+	if (div == uart_baud_div)
+		return;
+	uart_baud_div = div;
+	
+	// Undo the corrections that UART_Initialize would apply.
+	base = pgm_read_word(&uart_baud_divisors[uart_baud]);
+	cal = (((int32_t)div - base - ((base * (int8_t)SIGROW.OSC20ERR5V) / 1024)) *
+		BAUD_DIVISOR(9600)) / base;
+	
+	// Ignore anything too far off to be oscillator drift.
+	if ((cal < INT8_MIN) || (cal > INT8_MAX))
+		return;
+	
+	if (abs((int16_t)cal - Config_GetClockCalFactor()) >= UART_CAL_HYSTERESIS)
+		Config_SetClockCalFactor((int8_t)cal);
+}
+
 /**
  * Sends a byte via UART.
  * 
+ * The byte is only queued up in our transmit ring buffer and will be sent out
+ * by the data register empty interrupt, so this function only blocks when the
+ * ring buffer is full.
+ * 
  * @param b Byte to be sent.
  */
 void UART_SendByte(uint8_t b) {
-	// Wait for the TX buffer to be ready for more data.
-	while (!(USART0.STATUS & USART_DREIF_bm))
-		;
+	uint8_t next = (uart_tx_head + 1) & UART_TX_BUF_MASK;
+	
+	// Let someone take a peek at everything that we send.
+	if (uart_tap != NULL)
+		uart_tap(b);
 	
-	// Send byte.
+	// Divert the byte to the capture buffer if we are capturing.
+	if (uart_cap_buf != NULL) {
+		if (uart_cap_len < uart_cap_max) {
+			uart_cap_buf[uart_cap_len++] = (char)b;
+		} else {
+			uart_cap_overflow = true;
+		}
+		return;
+	}
+	
+	// Wait for some space in the ring buffer.
+	while (next == uart_tx_tail) {
+		// Drain it ourselves if we were called with interrupts disabled.
+		if (!(SREG & CPU_I_bm) && (USART0.STATUS & USART_DREIF_bm))
+			UART_HandleDataRegisterEmpty();
+	}
+	
+	// Queue the byte up.
+	uart_tx_buf[uart_tx_head] = b;
+	uart_tx_head = next;
+	
+	// Put the RS-485 transceiver in TX mode and start draining the buffer.
 	PORTB.OUTSET = TX_EN;
-	USART0.TXDATAL = b;
+	USART0.CTRLA |= USART_DREIE_bm;
 }
 
 /**
@@ -56,13 +174,7 @@ void UART_SendByte(uint8_t b) {
  * @param c Character to be sent.
  */
 void UART_SendChar(char c) {
-	// Wait for the TX buffer to be ready for more data.
-	while (!(USART0.STATUS & USART_DREIF_bm))
-		;
-	
-	// Send byte.
-	PORTB.OUTSET = TX_EN;
-	USART0.TXDATAL = (uint8_t)c;
+	UART_SendByte((uint8_t)c);
 }
 
 /**
@@ -73,15 +185,8 @@ void UART_SendChar(char c) {
 void UART_SendString(const char *str) {
 	const char *tmp = str;
 	
-	while (*tmp) {
-		// Wait for the TX buffer to be ready for more data.
-		while (!(USART0.STATUS & USART_DREIF_bm))
-			;
-
-		// Send data.
-		PORTB.OUTSET = TX_EN;
-		USART0.TXDATAL = (uint8_t)*tmp++;
-	}
+	while (*tmp)
+		UART_SendByte((uint8_t)*tmp++);
 }
 
 /**
@@ -108,32 +213,143 @@ void UART_SendUInt8(uint8_t n) {
 	UART_SendString(buf);
 }
 
+/**
+ * Sends an uint16_t as s string via UART.
+ * 
+ * @param n Number to be set.
+ */
+void UART_SendUInt16(uint16_t n) {
+	char buf[6];
+	
+	u16toa(buf, n);
+	UART_SendString(buf);
+}
+
 /**
  * Sends a whole string with a CRLF at the end via UART.
  * 
  * @param str String to be sent.
  */
 void UART_SendLine(const char *str) {
-	const char *tmp = str;
+	UART_SendString(str);
+	UART_SendByte((uint8_t)'\r');
+	UART_SendByte((uint8_t)'\n');
+}
+
+/**
+ * Blocks until everything in the transmit buffer has been sent out and the
+ * RS-485 transceiver is back in RX mode. Must be called with interrupts
+ * enabled.
+ */
+void UART_Flush(void) {
+	while ((uart_tx_head != uart_tx_tail) || (PORTB.OUT & TX_EN))
+		;
+}
+
+/**
+ * Starts diverting everything that would be sent into a buffer instead, so it
+ * can be sent at a later time. Anything that doesn't fit is discarded and
+ * flagged, see UART_CaptureOverflowed.
+ * 
+ * @param buf Buffer to capture the bytes into.
+ * @param len Length of the buffer including the NUL terminator.
+ */
+void UART_StartCapture(char *buf, uint8_t len) {
+	uart_cap_len = 0;
+	uart_cap_max = len - 1;
+	uart_cap_overflow = false;
+	uart_cap_buf = buf;
+}
+
+/**
+ * Stops capturing and NUL terminates the capture buffer.
+ * 
+ * @return Number of bytes that were captured.
+ */
+uint8_t UART_StopCapture(void) {
+	uart_cap_buf[uart_cap_len] = '\0';
+	uart_cap_buf = NULL;
 	
-	// Send string.
-	while (*tmp) {
-		// Wait for the TX buffer to be ready for more data.
-		while (!(USART0.STATUS & USART_DREIF_bm))
-			;
+	return uart_cap_len;
+}
+
+/**
+ * Checks if anything was discarded during the last capture because it didn't
+ * fit in the buffer.
+ * 
+ * @return TRUE if the capture was cut short.
+ */
+bool UART_CaptureOverflowed(void) {
+	return uart_cap_overflow;
+}
+
+/**
+ * Sets a function that gets called with every byte that is sent, before it's
+ * queued up or captured.
+ * 
+ * @param tap Function to be called or NULL to disable it.
+ */
+void UART_SetTap(uart_tap_t tap) {
+	uart_tap = tap;
+}
+
+/**
+ * Checks if we are currently transmitting anything.
+ * 
+ * @return TRUE if there's still data to be sent or being shifted out.
+ */
+bool UART_IsTransmitting(void) {
+	return (uart_tx_head != uart_tx_tail) || (PORTB.OUT & TX_EN);
+}
 
-		// Send data.
-		PORTB.OUTSET = TX_EN;
-		USART0.TXDATAL = (uint8_t)*tmp++;
+/**
+ * Gets the number of bytes that were sent out since the last reset.
+ * 
+ * @return Number of bytes sent.
+ */
+uint16_t UART_GetSentByteCount(void) {
+	uint16_t count;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		count = uart_tx_bytes;
 	}
 	
-	// Send CRLF.
-	while (!(USART0.STATUS & USART_DREIF_bm))
-		;
-	PORTB.OUTSET = TX_EN;
-	USART0.TXDATAL = (uint8_t)'\r';
-	while (!(USART0.STATUS & USART_DREIF_bm))
-		;
-	PORTB.OUTSET = TX_EN;
-	USART0.TXDATAL = (uint8_t)'\n';
+	return count;
+}
+
+/**
+ * Resets the number of bytes that were sent out.
+ */
+void UART_ResetSentByteCount(void) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		uart_tx_bytes = 0;
+	}
+}
+
+/**
+ * Handles the UART data register empty interrupt by feeding the next byte in
+ * the transmit ring buffer to the peripheral.
+ */
+void UART_HandleDataRegisterEmpty(void) {
+	// Stop the interrupt if there's nothing left to send.
+	if (uart_tx_head == uart_tx_tail) {
+		USART0.CTRLA &= ~USART_DREIE_bm;
+		return;
+	}
+	
+	// Send the next byte.
+	USART0.TXDATAL = uart_tx_buf[uart_tx_tail];
+	uart_tx_bytes++;
+	uart_tx_tail = (uart_tx_tail + 1) & UART_TX_BUF_MASK;
+}
+
+/**
+ * Handles the UART transmission complete interrupt by putting the RS-485
+ * transceiver back in RX mode if we have nothing else to send.
+ */
+void UART_HandleTransmitComplete(void) {
+	if (uart_tx_head == uart_tx_tail)
+		PORTB.OUTCLR = TX_EN;         // Put the RS-485 transceiver in RX mode.
+
+	USART0.STATUS = USART_TXCIF_bm;   // Clear the interrupt flag.
 }
@@ -13,19 +13,59 @@ extern "C" {
 #endif
 
 #include <inttypes.h>
+#include <stdbool.h>
+
+// Supported baud rates.
+typedef enum {
+	UART_BAUD_9600 = 0,
+	UART_BAUD_19200,
+	UART_BAUD_38400,
+	UART_BAUD_57600,
+	UART_BAUD_115200,
+	UART_BAUD_NUM
+} uart_baud_t;
+
+/*
+ * The receiver runs in generic auto-baud mode, so a master that precedes a
+ * frame with a break (at least 11 low bits) and a 0x55 sync character gets
+ * our baud rate divisor measured and corrected in hardware. After each valid
+ * frame the measured divisor is turned back into a clock calibration factor,
+ * which is stored whenever it drifts more than UART_CAL_HYSTERESIS steps, so
+ * we come back up tuned even before the next sync. Masters that never send
+ * breaks still work, relying on the stored factor. (Or CLKCAL+/CLKCAL-)
+ */
+#define UART_CAL_HYSTERESIS 16  // Clock calibration steps. (~0.2%)
 	
+// Transmit tap function.
+typedef void (*uart_tap_t)(uint8_t b);
+
 // Initialization
-void UART_Initialize(uint16_t baud);
+void UART_Initialize(uint8_t baud);
+uint8_t UART_GetBaudRate(void);
+void UART_TrackClockCal(void);
 
 // Transmission
 void UART_SendByte(uint8_t b);
 void UART_SendChar(char c);
 void UART_SendString(const char *str);
 void UART_SendLine(const char *str);
+void UART_Flush(void);
+bool UART_IsTransmitting(void);
+uint16_t UART_GetSentByteCount(void);
+void UART_ResetSentByteCount(void);
+void UART_StartCapture(char *buf, uint8_t len);
+void UART_SetTap(uart_tap_t tap);
+uint8_t UART_StopCapture(void);
+bool UART_CaptureOverflowed(void);
 
 // Numeric Transmissions
 void UART_SendInt8(int8_t n);
 void UART_SendUInt8(uint8_t n);
+void UART_SendUInt16(uint16_t n);
+
+// Interrupt Handlers
+void UART_HandleDataRegisterEmpty(void);
+void UART_HandleTransmitComplete(void);
 	
 #ifdef	__cplusplus
 }
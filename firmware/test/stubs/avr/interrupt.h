@@ -0,0 +1,17 @@
+/**
+ * avr/interrupt.h
+ * Interrupts are driven by hand in the host tests.
+ * 
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef STUB_AVR_INTERRUPT_H
+#define STUB_AVR_INTERRUPT_H
+
+#include <avr/io.h>
+
+#define ISR(vector) void vector(void); void vector(void)
+#define sei() (SREG |= CPU_I_bm)
+#define cli() (SREG &= ~CPU_I_bm)
+
+#endif	/* STUB_AVR_INTERRUPT_H */
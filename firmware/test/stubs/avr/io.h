@@ -0,0 +1,78 @@
+/**
+ * avr/io.h
+ * Just enough of the ATtiny806 peripherals for the host tests. Registers are
+ * plain variables that the tests poke at and inspect.
+ * 
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef STUB_AVR_IO_H
+#define STUB_AVR_IO_H
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+typedef volatile uint8_t register8_t;
+typedef volatile uint16_t register16_t;
+
+// Fuses and lock bits.
+#define FUSES struct { uint8_t WDTCFG, BODCFG, OSCCFG, SYSCFG0, SYSCFG1, \
+	APPEND, BOOTEND; } __fuse
+#define LOCKBITS uint8_t __lock
+
+// I/O ports.
+typedef struct {
+	register8_t DIR, DIRSET, DIRCLR, DIRTGL;
+	register8_t OUT, OUTSET, OUTCLR, OUTTGL;
+	register8_t IN, INTFLAGS, PORTCTRL;
+	register8_t PIN0CTRL, PIN1CTRL, PIN2CTRL, PIN3CTRL;
+	register8_t PIN4CTRL, PIN5CTRL, PIN6CTRL, PIN7CTRL;
+} PORT_t;
+extern PORT_t PORTA, PORTB, PORTC;
+
+// USART.
+typedef struct {
+	register8_t RXDATAL, RXDATAH, TXDATAL, TXDATAH;
+	register8_t STATUS, CTRLA, CTRLB, CTRLC;
+	register16_t BAUD;
+	register8_t CTRLD, DBGCTRL, EVCTRL, TXPLCTRL, RXPLCTRL;
+} USART_t;
+extern USART_t USART0;
+
+// Signature row.
+typedef struct {
+	register8_t OSC20ERR3V, OSC20ERR5V, OSC16ERR3V, OSC16ERR5V;
+	register8_t DEVICEID0, DEVICEID1, DEVICEID2;
+	register8_t SERNUM0, SERNUM1, SERNUM2, SERNUM3, SERNUM4;
+	register8_t SERNUM5, SERNUM6, SERNUM7, SERNUM8, SERNUM9;
+	register8_t TEMPSENSE0, TEMPSENSE1;
+} SIGROW_t;
+extern SIGROW_t SIGROW;
+
+// CPU status register.
+extern register8_t SREG;
+#define CPU_I_bm 0x80
+
+// USART bits.
+#define USART_RXCIF_bm          0x80
+#define USART_TXCIF_bm          0x40
+#define USART_DREIF_bm          0x20
+#define USART_RXSIF_bm          0x10
+#define USART_ISFIF_bm          0x08
+#define USART_BDF_bm            0x02
+#define USART_WFB_bm            0x01
+#define USART_BUFOVF_bm         0x40
+#define USART_FERR_bm           0x04
+#define USART_PERR_bm           0x02
+#define USART_RXCIE_bm          0x80
+#define USART_TXCIE_bm          0x40
+#define USART_DREIE_bm          0x20
+#define USART_RXSIE_bm          0x10
+#define USART_ABEIE_bm          0x04
+#define USART_RXEN_bm           0x80
+#define USART_TXEN_bm           0x40
+#define USART_SFDEN_bm          0x10
+#define USART_RXMODE_GENAUTO_gc 0x04
+
+#endif	/* STUB_AVR_IO_H */
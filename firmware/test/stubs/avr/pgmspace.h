@@ -0,0 +1,21 @@
+/**
+ * avr/pgmspace.h
+ * The host has a single address space, so flash is just memory.
+ * 
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef STUB_AVR_PGMSPACE_H
+#define STUB_AVR_PGMSPACE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(str) (str)
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define pgm_read_ptr(addr)  (*(void * const *)(addr))
+#define strcmp_P(a, b)      strcmp((a), (b))
+
+#endif	/* STUB_AVR_PGMSPACE_H */
@@ -0,0 +1,15 @@
+/**
+ * registers.c
+ * Storage for the stubbed peripheral registers.
+ * 
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <avr/io.h>
+
+PORT_t PORTA;
+PORT_t PORTB;
+PORT_t PORTC;
+USART_t USART0;
+SIGROW_t SIGROW;
+register8_t SREG;
@@ -0,0 +1,15 @@
+/**
+ * util/atomic.h
+ * Nothing interrupts the host tests, so atomic blocks just run once.
+ * 
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef STUB_UTIL_ATOMIC_H
+#define STUB_UTIL_ATOMIC_H
+
+#define ATOMIC_RESTORESTATE 0
+#define ATOMIC_BLOCK(type) for (int atomic_once = 1; atomic_once; \
+	atomic_once = 0)
+
+#endif	/* STUB_UTIL_ATOMIC_H */
@@ -0,0 +1,14 @@
+/**
+ * util/delay.h
+ * There's no point in waiting around in the host tests.
+ * 
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef STUB_UTIL_DELAY_H
+#define STUB_UTIL_DELAY_H
+
+#define _delay_ms(ms) ((void)(ms))
+#define _delay_us(us) ((void)(us))
+
+#endif	/* STUB_UTIL_DELAY_H */
@@ -0,0 +1,39 @@
+/**
+ * test.h
+ * Tiny helpers for the host tests.
+ * 
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef TEST_H
+#define	TEST_H
+
+#include <stdio.h>
+
+// Number of checks that have failed so far.
+extern int test_failures;
+
+/**
+ * Checks a condition, reporting it if it doesn't hold.
+ * 
+ * @param cond Condition that must be true.
+ */
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+		test_failures++; \
+	} \
+} while (0)
+
+/**
+ * Runs a test function and reports it.
+ * 
+ * @param fn Test function to be run.
+ */
+#define RUN_TEST(fn) do { \
+	int before = test_failures; \
+	fn(); \
+	printf("%s %s\n", (test_failures == before) ? "PASS" : "FAIL", #fn); \
+} while (0)
+
+#endif	/* TEST_H */
@@ -0,0 +1,388 @@
+/**
+ * test_enumerate.c
+ * Runs the master's side of an enumeration session against a bus full of
+ * simulated nodes, switching the serial number and session state of the
+ * firmware around to play each one of them.
+ * 
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <avr/io.h>
+#include <stdlib.h>
+#include <string.h>
+#include "test.h"
+#include "enumerate.h"
+#include "nvmconfig.h"
+#include "strutils.h"
+
+// Some definitions.
+#define NODES_MAX  64
+#define ENUM_SLOTS (1 << ENUM_SLOT_BITS)
+
+// Simulated node.
+typedef struct {
+	uint8_t serial[ENUM_SERIAL_LEN];
+	bool addr_set;
+	bool active;
+	uint8_t addr;
+} node_t;
+
+// Private variables.
+int test_failures;
+static node_t nodes[NODES_MAX];
+static uint8_t nodes_num;
+static node_t *node_cur;
+static uint8_t next_addr;
+static uint16_t queries;
+
+/**
+ * Configuration stub that answers for the node that's being played.
+ */
+bool Config_GetFlag(uint8_t flag) {
+	return (flag == CONFIG_FLAG_ADDR_SET) && node_cur->addr_set;
+}
+
+/**
+ * Switches the firmware over to play a node.
+ * 
+ * @param node Node to be played.
+ */
+static void Node_Enter(node_t *node) {
+	node_cur = node;
+	memcpy((void *)&SIGROW.SERNUM0, node->serial, ENUM_SERIAL_LEN);
+	if (node->active) {
+		Enum_Reset(true);
+	} else {
+		Enum_Leave();
+	}
+}
+
+/**
+ * Saves the state of the node that's being played.
+ */
+static void Node_Exit(void) {
+	// Any node in the session answers an empty prefix.
+	node_cur->active = Enum_Match(0, NULL) >= 0;
+}
+
+/**
+ * Handles a broadcast ENUMRST on a node.
+ * 
+ * @param node Node that received it.
+ * @param all  Should nodes with an address take part?
+ */
+static void Node_ResetEnumeration(node_t *node, bool all) {
+	Node_Enter(node);
+	Enum_Reset(all);
+	Node_Exit();
+}
+
+/**
+ * Handles a broadcast ENUM on a node, building the reply like Cmd_Enumerate.
+ * 
+ * @param  node   Node that received it.
+ * @param  bits   Number of bits of the prefix.
+ * @param  prefix Serial number prefix.
+ * @param  reply  Buffer for the reply.
+ * @return        Slot of the reply or -1 if the node stayed quiet.
+ */
+static int8_t Node_Enumerate(node_t *node, uint8_t bits, const uint8_t *prefix,
+							 char *reply) {
+	char serial[(ENUM_SERIAL_LEN * 2) + 1];
+	int8_t slot;
+	
+	Node_Enter(node);
+	slot = Enum_Match(bits, prefix);
+	if (slot >= 0) {
+		Enum_GetSerialStr(serial);
+		sprintf(reply, "ENUM %u %s", slot, serial);
+	}
+	Node_Exit();
+	
+	return slot;
+}
+
+/**
+ * Handles a broadcast ASSIGN on a node.
+ * 
+ * @param node   Node that received it.
+ * @param addr   Address to be assigned.
+ * @param serial Serial number of the node that should take it.
+ */
+static void Node_AssignAddress(node_t *node, uint8_t addr,
+							   const uint8_t *serial) {
+	Node_Enter(node);
+	if (Enum_IsOurSerial(serial)) {
+		node->addr = addr;
+		node->addr_set = true;
+		Enum_Leave();
+	}
+	Node_Exit();
+}
+
+/**
+ * Parses a clean ENUM reply like the master would.
+ * 
+ * @param  reply  Reply from the bus.
+ * @param  slot   Slot that the reply was received in.
+ * @param  serial Buffer for the serial number in the reply.
+ * @return        FALSE if the reply doesn't make sense.
+ */
+static bool Master_ParseReply(const char *reply, uint8_t slot,
+							  uint8_t *serial) {
+	char *end;
+	uint8_t i;
+	
+	if (strncmp(reply, "ENUM ", 5) != 0)
+		return false;
+	if (strtoul(reply + 5, &end, 10) != slot)
+		return false;
+	if ((*end != ' ') || (strlen(end + 1) != (ENUM_SERIAL_LEN * 2)))
+		return false;
+	
+	for (i = 0; i < ENUM_SERIAL_LEN; i++) {
+		char hex[3] = { end[1 + (i * 2)], end[2 + (i * 2)], '\0' };
+		serial[i] = (uint8_t)strtoul(hex, NULL, 16);
+	}
+	
+	return true;
+}
+
+/**
+ * Asks every node with a serial number starting with a prefix to reply and
+ * either assigns an address to the ones that replied alone in their slot or
+ * digs further into the slots that had a collision.
+ * 
+ * @param bits   Number of bits of the prefix.
+ * @param prefix Serial number prefix.
+ */
+static void Master_Enumerate(uint8_t bits, const uint8_t *prefix) {
+	char replies[ENUM_SLOTS][48];
+	char reply[48];
+	uint8_t count[ENUM_SLOTS] = { 0 };
+	uint8_t serial[ENUM_SERIAL_LEN];
+	uint8_t next[ENUM_SERIAL_LEN];
+	uint8_t slot;
+	uint8_t i;
+	int8_t s;
+	
+	// Broadcast the query and listen to every slot.
+	queries++;
+	for (i = 0; i < nodes_num; i++) {
+		s = Node_Enumerate(&nodes[i], bits, prefix, reply);
+		if (s < 0)
+			continue;
+		
+		// Replies that share a slot get garbled, so only keep the first one.
+		if (count[s]++ == 0)
+			strcpy(replies[s], reply);
+	}
+	
+	for (slot = 0; slot < ENUM_SLOTS; slot++) {
+		if (count[slot] == 1) {
+			// A single node, so give it an address.
+			CHECK(Master_ParseReply(replies[slot], slot, serial));
+			for (i = 0; i < nodes_num; i++)
+				Node_AssignAddress(&nodes[i], next_addr, serial);
+			next_addr++;
+		} else if (count[slot] > 1) {
+			// Collision, so let's look at this branch on its own.
+			CHECK((bits + ENUM_SLOT_BITS) <= ENUM_SERIAL_BITS);
+			if ((bits + ENUM_SLOT_BITS) > ENUM_SERIAL_BITS)
+				continue;
+			
+			memcpy(next, prefix, sizeof(next));
+			for (i = 0; i < ENUM_SLOT_BITS; i++) {
+				uint8_t bit = bits + i;
+				
+				next[bit / 8] &= ~(0x80 >> (bit % 8));
+				if (slot & (1 << (ENUM_SLOT_BITS - 1 - i)))
+					next[bit / 8] |= 0x80 >> (bit % 8);
+			}
+			Master_Enumerate(bits + ENUM_SLOT_BITS, next);
+		}
+	}
+}
+
+/**
+ * Runs a whole enumeration session on the bus.
+ * 
+ * @param all Should nodes with an address take part?
+ */
+static void Master_Session(bool all) {
+	uint8_t prefix[ENUM_SERIAL_LEN] = { 0 };
+	uint8_t i;
+	
+	for (i = 0; i < nodes_num; i++)
+		Node_ResetEnumeration(&nodes[i], all);
+	
+	queries = 0;
+	Master_Enumerate(0, prefix);
+}
+
+/**
+ * Adds a node to the bus.
+ * 
+ * @param  serial Serial number of the node.
+ * @return        Node that was added.
+ */
+static node_t* Bus_AddNode(const uint8_t *serial) {
+	node_t *node = &nodes[nodes_num++];
+	
+	memset(node, 0, sizeof(node_t));
+	memcpy(node->serial, serial, ENUM_SERIAL_LEN);
+	
+	return node;
+}
+
+/**
+ * Adds a node with a pseudo-random serial number to the bus.
+ * 
+ * @return Node that was added.
+ */
+static node_t* Bus_AddRandomNode(void) {
+	uint8_t serial[ENUM_SERIAL_LEN];
+	uint8_t i;
+	
+	for (i = 0; i < ENUM_SERIAL_LEN; i++)
+		serial[i] = (uint8_t)(rand() >> 7);
+	
+	return Bus_AddNode(serial);
+}
+
+/**
+ * Gets the most ENUM queries that a session may take to find every node on a
+ * bus with random serial numbers: one for each node on every level of the slot
+ * tree that's needed to tell them apart, plus the first one.
+ * (n * ceil(log8 n) + 1)
+ * 
+ * @param  n Number of nodes on the bus.
+ * @return   Maximum number of queries.
+ */
+static uint16_t Master_QueryBound(uint8_t n) {
+	uint16_t reach = 1;
+	uint8_t levels = 0;
+	
+	while (reach < n) {
+		reach *= ENUM_SLOTS;
+		levels++;
+	}
+	
+	return ((uint16_t)n * levels) + 1;
+}
+
+/**
+ * Checks that every node that was supposed to get an address got a unique
+ * one.
+ * 
+ * @param from First address that was handed out.
+ */
+static void Bus_CheckAddresses(uint8_t from) {
+	uint8_t i;
+	uint8_t j;
+	
+	for (i = 0; i < nodes_num; i++) {
+		CHECK(nodes[i].addr_set);
+		CHECK(!nodes[i].active);
+		for (j = i + 1; j < nodes_num; j++)
+			CHECK(nodes[i].addr != nodes[j].addr);
+	}
+	CHECK(next_addr == (from + nodes_num));
+}
+
+/**
+ * Gets everything ready for a new test with an empty bus.
+ */
+static void Setup(void) {
+	nodes_num = 0;
+	next_addr = 1;
+	srand(806);
+}
+
+/**
+ * A single node replies in a clean slot straight away.
+ */
+static void Test_SingleNode(void) {
+	Setup();
+	Bus_AddRandomNode();
+	
+	Master_Session(false);
+	CHECK(queries == 1);
+	Bus_CheckAddresses(1);
+}
+
+/**
+ * A bus full of nodes gets addressed no matter how their slots collide, and
+ * without walking through more of the slot tree than it has to.
+ */
+static void Test_ManyNodes(void) {
+	uint8_t n;
+	uint8_t i;
+	
+	for (n = 2; n <= NODES_MAX; n *= 2) {
+		Setup();
+		for (i = 0; i < n; i++)
+			Bus_AddRandomNode();
+		
+		Master_Session(false);
+		Bus_CheckAddresses(1);
+		CHECK(queries <= Master_QueryBound(n));
+	}
+}
+
+/**
+ * Nodes whose serial numbers only differ in their last bit collide all the way
+ * down to it.
+ */
+static void Test_LastBitDiffers(void) {
+	uint8_t serial[ENUM_SERIAL_LEN];
+	
+	Setup();
+	memset(serial, 0xA5, sizeof(serial));
+	Bus_AddNode(serial);
+	serial[ENUM_SERIAL_LEN - 1] ^= 0x01;
+	Bus_AddNode(serial);
+	serial[0] ^= 0x80;
+	Bus_AddNode(serial);
+	
+	// Only a single branch goes all the way down the serial number.
+	Master_Session(false);
+	Bus_CheckAddresses(1);
+	CHECK(queries <= ((ENUM_SERIAL_BITS / ENUM_SLOT_BITS) + 1));
+}
+
+/**
+ * Nodes that already have an address only take part when asked to.
+ */
+static void Test_AlreadyAddressed(void) {
+	node_t *node;
+	
+	Setup();
+	Bus_AddRandomNode();
+	node = Bus_AddRandomNode();
+	node->addr_set = true;
+	node->addr = 200;
+	
+	Master_Session(false);
+	CHECK(nodes[0].addr == 1);
+	CHECK(node->addr == 200);
+	CHECK(next_addr == 2);
+	
+	next_addr = 10;
+	Master_Session(true);
+	Bus_CheckAddresses(10);
+}
+
+/**
+ * Test runner.
+ * 
+ * @return Number of failed checks.
+ */
+int main(void) {
+	RUN_TEST(Test_SingleNode);
+	RUN_TEST(Test_ManyNodes);
+	RUN_TEST(Test_LastBitDiffers);
+	RUN_TEST(Test_AlreadyAddressed);
+	
+	return test_failures;
+}
@@ -0,0 +1,257 @@
+/**
+ * test_uart.c
+ * Checks the order in which the transmit ring buffer puts bytes on the wire
+ * and when the RS-485 transceiver is switched between RX and TX.
+ * 
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <string.h>
+#include "test.h"
+#include "global_pins.h"
+#include "uart.h"
+
+// Functions from uart.c that are called from interrupts.
+void UART_HandleDataRegisterEmpty(void);
+void UART_HandleTransmitComplete(void);
+
+// Bytes that made it to the wire.
+typedef struct {
+	uint8_t buf[128];
+	uint8_t len;
+	bool tx_en_low;  // A byte was sent while TX_EN was low.
+} wire_t;
+
+// Private variables.
+int test_failures;
+static wire_t wire;
+static char capture[8];
+
+/**
+ * Configuration stubs.
+ */
+int8_t Config_GetClockCalFactor(void) {
+	return 0;
+}
+void Config_SetClockCalFactor(int8_t cal) {
+}
+
+/**
+ * Applies the strobe registers of PORTB to its output like the hardware does.
+ */
+static void Port_Update(void) {
+	PORTB.OUT |= PORTB.OUTSET;
+	PORTB.OUT &= ~PORTB.OUTCLR;
+	PORTB.OUTSET = 0;
+	PORTB.OUTCLR = 0;
+}
+
+/**
+ * Fires the data register empty interrupt like the USART would, recording
+ * every byte that gets written to it.
+ * 
+ * @return FALSE if the interrupt wasn't enabled.
+ */
+static bool Wire_DataRegisterEmpty(void) {
+	uint16_t sent = UART_GetSentByteCount();
+	
+	if (!(USART0.CTRLA & USART_DREIE_bm))
+		return false;
+	
+	UART_HandleDataRegisterEmpty();
+	Port_Update();
+	if (UART_GetSentByteCount() != sent) {
+		wire.buf[wire.len++] = USART0.TXDATAL;
+		if (!(PORTB.OUT & TX_EN))
+			wire.tx_en_low = true;
+	}
+	
+	return true;
+}
+
+/**
+ * Fires the transmission complete interrupt like the USART would once the
+ * last byte has been shifted out.
+ */
+static void Wire_TransmitComplete(void) {
+	UART_HandleTransmitComplete();
+	Port_Update();
+}
+
+/**
+ * Lets the USART send everything that's queued up.
+ */
+static void Wire_Drain(void) {
+	while (Wire_DataRegisterEmpty())
+		;
+	Wire_TransmitComplete();
+}
+
+/**
+ * Gets everything ready for a new test with an idle bus.
+ */
+static void Setup(void) {
+	memset(&wire, 0, sizeof(wire));
+	UART_Initialize(UART_BAUD_9600);
+	Port_Update();
+	UART_ResetSentByteCount();
+	USART0.STATUS = USART_DREIF_bm;
+}
+
+/**
+ * Bytes come out in the order that they were queued up.
+ */
+static void Test_ByteOrder(void) {
+	Setup();
+	
+	UART_SendString(":5 OK");
+	UART_SendByte(0x00);
+	UART_SendByte(0xFF);
+	UART_SendLine("");
+	Wire_Drain();
+	
+	CHECK(wire.len == 9);
+	CHECK(memcmp(wire.buf, ":5 OK\x00\xFF\r\n", 9) == 0);
+	CHECK(UART_GetSentByteCount() == 9);
+}
+
+/**
+ * Wrapping around the ring buffer keeps the order intact.
+ */
+static void Test_RingWrap(void) {
+	uint8_t i;
+	uint8_t j;
+	
+	Setup();
+	
+	for (i = 0; i < 5; i++) {
+		for (j = 0; j < 20; j++)
+			UART_SendByte((i * 20) + j);
+		Wire_Drain();
+	}
+	
+	CHECK(wire.len == 100);
+	for (i = 0; i < wire.len; i++)
+		CHECK(wire.buf[i] == i);
+}
+
+/**
+ * A full ring buffer with interrupts disabled gets drained by the sender
+ * itself instead of locking up.
+ */
+static void Test_FullWithInterruptsOff(void) {
+	uint8_t i;
+	
+	Setup();
+	
+	cli();
+	for (i = 0; i < 100; i++) {
+		UART_SendByte(i);
+		Port_Update();
+		
+		// Anything the sender pushed out itself is on the wire already.
+		if (UART_GetSentByteCount() > wire.len)
+			wire.buf[wire.len++] = USART0.TXDATAL;
+	}
+	sei();
+	Wire_Drain();
+	
+	CHECK(wire.len == 100);
+	for (i = 0; i < wire.len; i++)
+		CHECK(wire.buf[i] == i);
+}
+
+/**
+ * The transceiver is only in TX mode from the first byte that is queued up
+ * until the last one has been completely shifted out.
+ */
+static void Test_TxEnableTiming(void) {
+	Setup();
+	CHECK(!(PORTB.OUT & TX_EN));
+	CHECK(!UART_IsTransmitting());
+	
+	// Switch to TX as soon as there's something to send.
+	UART_SendString("AB");
+	Port_Update();
+	CHECK(PORTB.OUT & TX_EN);
+	CHECK(UART_IsTransmitting());
+	
+	// Stay in TX while the last byte is still being shifted out.
+	while (Wire_DataRegisterEmpty())
+		;
+	CHECK(PORTB.OUT & TX_EN);
+	CHECK(UART_IsTransmitting());
+	
+	// Only go back to RX once it's out.
+	Wire_TransmitComplete();
+	CHECK(!(PORTB.OUT & TX_EN));
+	CHECK(!UART_IsTransmitting());
+	CHECK(!wire.tx_en_low);
+	CHECK(USART0.STATUS & USART_TXCIF_bm);
+}
+
+/**
+ * A byte queued up right before the transmission complete interrupt keeps the
+ * transceiver in TX mode.
+ */
+static void Test_TxEnableRace(void) {
+	Setup();
+	
+	UART_SendChar('A');
+	Wire_DataRegisterEmpty();
+	Wire_DataRegisterEmpty();
+	CHECK(!(USART0.CTRLA & USART_DREIE_bm));
+	
+	// The first byte finishes just as the next one gets queued up.
+	UART_SendChar('B');
+	Port_Update();
+	Wire_TransmitComplete();
+	CHECK(PORTB.OUT & TX_EN);
+	
+	Wire_Drain();
+	CHECK(!(PORTB.OUT & TX_EN));
+	CHECK((wire.len == 2) && (wire.buf[0] == 'A') && (wire.buf[1] == 'B'));
+	CHECK(!wire.tx_en_low);
+}
+
+/**
+ * Captured bytes never make it to the wire and overflows get flagged.
+ */
+static void Test_Capture(void) {
+	Setup();
+	
+	UART_StartCapture(capture, sizeof(capture));
+	UART_SendString("OK");
+	CHECK(UART_StopCapture() == 2);
+	CHECK(strcmp(capture, "OK") == 0);
+	CHECK(!UART_CaptureOverflowed());
+	Port_Update();
+	CHECK(!(PORTB.OUT & TX_EN));
+	CHECK(!(USART0.CTRLA & USART_DREIE_bm));
+	
+	UART_StartCapture(capture, sizeof(capture));
+	UART_SendString("TOO LONG");
+	CHECK(UART_StopCapture() == (sizeof(capture) - 1));
+	CHECK(UART_CaptureOverflowed());
+	
+	Wire_Drain();
+	CHECK(wire.len == 0);
+}
+
+/**
+ * Test runner.
+ * 
+ * @return Number of failed checks.
+ */
+int main(void) {
+	RUN_TEST(Test_ByteOrder);
+	RUN_TEST(Test_RingWrap);
+	RUN_TEST(Test_FullWithInterruptsOff);
+	RUN_TEST(Test_TxEnableTiming);
+	RUN_TEST(Test_TxEnableRace);
+	RUN_TEST(Test_Capture);
+	
+	return test_failures;
+}
@@ -0,0 +1,172 @@
+#!/usr/bin/env python3
+
+"""
+bootimage.py
+Post-build steps that get images ready to live alongside the bootloader.
+
+  bootimage.py info IMAGE   Adds the information page that the bootloader
+                            checks before running the application, so an
+                            application flashed over UPDI is accepted.
+  bootimage.py check IMAGE  Makes sure the bootloader fits in its section.
+
+IMAGE may be the ELF or the HEX file of the build, the HEX file next to it is
+the one that gets used (and modified).
+
+@author Nathan Campos <nathan@innoveworkshop.com>
+"""
+
+import os
+import re
+import sys
+
+# Device definitions. (ATtiny806)
+FLASH_SIZE = 8192
+PAGE_SIZE = 64
+
+# Where our configuration lives.
+CONFIG_H = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..",
+                        "firmware", "src", "config.h")
+
+
+def boot_section_size():
+    """Gets the size of the bootloader section from the firmware's config.h."""
+    with open(CONFIG_H) as f:
+        m = re.search(r"#define\s+BOOT_SECTION_SIZE\s+(\w+)", f.read())
+    if m is None:
+        raise SystemExit("BOOT_SECTION_SIZE not found in " + CONFIG_H)
+
+    return int(m.group(1), 0)
+
+
+def crc_xmodem(data):
+    """Calculates the CRC-16/XMODEM of some data like _crc_xmodem_update."""
+    crc = 0
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if (crc & 0x8000) else (crc << 1)
+            crc &= 0xFFFF
+
+    return crc
+
+
+def read_hex(path):
+    """Reads the records of an Intel HEX file."""
+    lines = []
+
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if not line:
+                continue
+            if not line.startswith(":"):
+                raise SystemExit("%s: not an Intel HEX file" % path)
+            if (sum(bytes.fromhex(line[1:])) & 0xFF) != 0:
+                raise SystemExit("%s: bad checksum in %s" % (path, line))
+            lines.append(line)
+
+    return lines
+
+
+def flash_bytes(lines):
+    """Gets a map of the flash bytes in the records of an Intel HEX file."""
+    flash = {}
+    upper = 0
+
+    for line in lines:
+        rec = bytes.fromhex(line[1:])
+        length = rec[0]
+        addr = (rec[1] << 8) | rec[2]
+        rtype = rec[3]
+        data = rec[4:4 + length]
+
+        if rtype == 0x00:
+            for i, b in enumerate(data):
+                if (upper + addr + i) < FLASH_SIZE:
+                    flash[upper + addr + i] = b
+        elif rtype == 0x02:
+            upper = ((data[0] << 8) | data[1]) << 4
+        elif rtype == 0x04:
+            upper = ((data[0] << 8) | data[1]) << 16
+
+    return flash
+
+
+def hex_record(addr, rtype, data):
+    """Builds a single Intel HEX record."""
+    rec = bytes([len(data), (addr >> 8) & 0xFF, addr & 0xFF, rtype]) + data
+    return ":%s%02X" % (rec.hex().upper(), (-sum(rec)) & 0xFF)
+
+
+def hex_path(path):
+    """Gets the HEX file that goes with a build output."""
+    return os.path.splitext(path)[0] + ".hex"
+
+
+def add_info(path):
+    """Adds the information page of the application image to its HEX file."""
+    app_start = boot_section_size()
+    app_pages = ((FLASH_SIZE - app_start) // PAGE_SIZE) - 1
+    info_addr = app_start + (app_pages * PAGE_SIZE)
+
+    lines = read_hex(path)
+    eof = [i for i, l in enumerate(lines) if l[7:9] == "01"]
+    if not eof:
+        raise SystemExit("%s: missing end of file record" % path)
+    eof = eof[0]
+
+    # Drop the information page that a previous run might have added.
+    ext = hex_record(0, 0x04, b"\x00\x00")
+    if (eof >= 2) and (lines[eof - 2] == ext) and \
+            (int(lines[eof - 1][3:7], 16) == info_addr):
+        del lines[eof - 2:eof]
+        eof -= 2
+
+    flash = flash_bytes(lines)
+    if not flash:
+        raise SystemExit("%s: image is empty" % path)
+    if min(flash) < app_start:
+        raise SystemExit("%s: image overlaps the bootloader" % path)
+
+    # The image is whole pages with anything that wasn't programmed erased.
+    end = max(flash) + 1
+    pages = (end - app_start + PAGE_SIZE - 1) // PAGE_SIZE
+    if (end > info_addr) or (pages > app_pages):
+        raise SystemExit("%s: image overlaps the information page" % path)
+
+    image = bytes(flash.get(app_start + i, 0xFF)
+                  for i in range(pages * PAGE_SIZE))
+    crc = crc_xmodem(image)
+
+    # boot_info_t as laid out by avr-gcc: pages, crc (little endian).
+    info = bytes([pages, crc & 0xFF, crc >> 8])
+    lines[eof:eof] = [ext, hex_record(info_addr, 0x00, info)]
+
+    with open(path, "w") as f:
+        f.write("\n".join(lines) + "\n")
+
+    print("%s: %d pages, CRC 0x%04X" % (path, pages, crc))
+
+
+def check_size(path):
+    """Makes sure that the bootloader fits in its section of the flash."""
+    size = boot_section_size()
+    flash = flash_bytes(read_hex(path))
+
+    used = (max(flash) + 1) if flash else 0
+    if used > size:
+        raise SystemExit("%s: bootloader needs %d bytes but only %d are "
+                         "reserved for it (BOOT_SECTION_SIZE)" %
+                         (path, used, size))
+
+    print("%s: %d of %d bytes used" % (path, used, size))
+
+
+if __name__ == "__main__":
+    if (len(sys.argv) != 3) or (sys.argv[1] not in ("info", "check")):
+        raise SystemExit(__doc__)
+
+    if sys.argv[1] == "info":
+        add_info(hex_path(sys.argv[2]))
+    else:
+        check_size(hex_path(sys.argv[2]))